@@ -0,0 +1,379 @@
+#include "sph.h"
+#include <errno.h>
+
+/* Microbenchmarks of the solver phases on fixed particle configurations.
+ * Runs on a single rank, 'make bench' builds it once with the all-pairs
+ * neighbor search and once with -DBUCKET.
+ *
+ * With -l it replays a snapshot written by 'sph -s step' instead, which
+ * needs a build with the same BUCKET/BLOCK_STEP/CSR_PAIRS flags as the
+ * solver.
+ */
+
+/* Internals of sph.c the phases work on */
+extern int_t n_virt, n_mirror, n_pairs, n_halo;
+extern particle_t *list;
+extern pair_t *pairs;
+extern real_t halo_width, halo_reach;
+
+typedef struct {
+    const char *name;
+    bool splash;            // Collapsed column instead of the initial one
+    real_t scale, delta;
+} config_t;
+
+/* Sizes grow with scale, density with 1/delta */
+static const config_t configs[] = {
+    { "lattice", false, 0.5, 0.01 },
+    { "lattice", false, 1.0, 0.01 },
+    { "lattice", false, 0.5, 0.005 },
+    { "splash", true, 0.5, 0.01 },
+    { "splash", true, 1.0, 0.01 }
+};
+
+typedef struct {
+    const char *name;
+    void (*phase) ( void );
+    bool per_pair;          // Rate in pairs/s rather than particles/s
+} phase_t;
+
+static void near_wall_scan ( void );
+static void hash_lookup ( void );
+static void hash_reinsert ( void );
+static void hash_marshal ( void );
+
+static const phase_t phases[] = {
+    { "find_near_wall", near_wall_scan, false },
+    { "generate_virtual_particles", generate_virtual_particles, false },
+    { "find_neighbors", find_neighbors, true },
+#ifdef BUCKET
+    { "find_neighbors_buckets_ws", find_neighbors_buckets_ws, true },
+#endif //BUCKET
+    { "kernel", kernel, true },
+    { "cont_density", cont_density, true },
+    { "correction", correction, true },
+    { "int_force", int_force, true },
+    { "hash lookup", hash_lookup, false },
+    { "hash remove+insert", hash_reinsert, false },
+    { "hash marshal", hash_marshal, false }
+};
+
+static int repetitions = 10;
+static int_t max_all_pairs = 12000;  // Skip find_neighbors above this
+static char
+    *only = NULL,                   // Run configurations with this name
+    *only_phase = NULL,             // Run only this phase
+    *kernel_name = "quintic",       // Smoothing kernel of the configurations
+    *replay = NULL;                 // Snapshot file to replay
+
+
+/* Deterministic pseudo-random numbers in [0,1) */
+static uint64_t seed;
+static real_t
+uniform ( void )
+{
+    seed ^= seed << 13, seed ^= seed >> 7, seed ^= seed << 17;
+    return (seed >> 11) * (1.0 / 9007199254740992.0);
+}
+
+
+/* Near-wall set of a freshly built list, as at the start of a step */
+static void
+near_wall_scan ( void )
+{
+    find_near_wall ( 0.0 );
+}
+
+
+static void
+hash_lookup ( void )
+{
+    particle_t *p;
+    for ( int_t k=0; k<n_field; k++ )
+        lookup_particle ( list[k].idx, &p );
+}
+
+
+static void
+hash_reinsert ( void )
+{
+    particle_t *actuals[n_field];
+    list_particles ( actuals );
+    for ( int_t k=0; k<n_field; k++ )
+        remove_particle ( actuals[k] );
+    for ( int_t k=0; k<n_field; k++ )
+        insert_particle ( actuals[k] );
+}
+
+
+static void
+hash_marshal ( void )
+{
+    marshal_particles ( &(list[0]) );
+}
+
+
+/* Move the initial column into a collapsed state: a jittered layer of
+ * the same area along the tank floor, and a sparser jet running up the
+ * right wall with a tenth of the particles
+ */
+static void
+collapse ( void )
+{
+    particle_t *actuals[n_field];
+    list_particles ( actuals );
+    int_t
+        n_jet = n_field / 10,
+        columns = (B - 2*H) / DELTA,
+        jet_columns = 0.3 * L / (2*DELTA);
+    real_t depth = (T * L) / B;
+
+    seed = 88172645463325252ULL;
+    for ( int_t k=0; k<n_field; k++ )
+    {
+        particle_t *p = actuals[k];
+        if ( k < n_field - n_jet )
+        {
+            p->x[0] = H + (k % columns) * DELTA;
+            p->x[1] = H + (k / columns) * DELTA;
+            p->v[0] = sqrt ( 2*9.81*T ) * (1.0 - p->x[0]/B);
+            p->v[1] = 0.0;
+        }
+        else
+        {
+            int_t j = k - (n_field - n_jet);
+            p->x[0] = B - H - (j % jet_columns) * 2*DELTA;
+            p->x[1] = depth + H + (j / jet_columns) * 2*DELTA;
+            p->v[0] = -0.1 * sqrt ( 2*9.81*T );
+            p->v[1] = sqrt ( 2*9.81*T );
+        }
+        p->x[0] += 0.25 * DELTA * (uniform() - 0.5);
+        p->x[1] += 0.25 * DELTA * (uniform() - 0.5);
+        p->x[1] = MIN ( p->x[1], 1.4*T );
+        p->p = density * 9.81 * MAX ( 0.0, depth - p->x[1] );
+    }
+}
+
+
+/* Set up a configuration the way time_integration() starts a step: the
+ * marshalled field particles, their ghosts, pairs and kernel values
+ */
+static void
+setup ( const config_t *c, problem_t *defaults )
+{
+    char scale[64], delta[64], smoothing[64], *argv[] = {
+        "bench", "-p", scale, "-p", delta, "-p", smoothing, NULL
+    };
+    sprintf ( scale, "scale=%lf", c->scale );
+    sprintf ( delta, "DELTA=%lf", c->delta );
+    sprintf ( smoothing, "kernel=%s", kernel_name );
+    problem = *defaults;
+    optind = 1;
+    options ( 7, argv );
+    halo_width = halo_reach = RADIUS;
+
+    initialize ();
+    if ( c->splash )
+        collapse ();
+    n_field = n_particles ();
+    resize_list ( n_field );
+    marshal_particles ( &(list[0]) );
+    n_halo = n_mirror = 0;
+    find_near_wall ( 0.0 );
+    generate_virtual_particles ();
+#ifdef BUCKET
+    find_neighbors_buckets_ws ();
+#else
+    find_neighbors ();
+#endif //BUCKET
+    kernel ();
+}
+
+
+static int
+compare ( const void *a, const void *b )
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+
+/* Working set the phases start from, restored before every repetition */
+typedef struct {
+    particle_t *list, *base;    // Copy of the list, and where it was
+    pair_t *pairs;
+    int_t n_virt, n_pairs;
+} state_t;
+
+
+static void
+save_state ( state_t *st )
+{
+    int_t n_list = n_field + n_virt + n_mirror;
+    st->list = malloc ( n_list * sizeof(particle_t) );
+    st->pairs = malloc ( n_pairs * sizeof(pair_t) );
+    memcpy ( st->list, list, n_list * sizeof(particle_t) );
+    memcpy ( st->pairs, pairs, n_pairs * sizeof(pair_t) );
+    st->n_virt = n_virt, st->n_pairs = n_pairs;
+    st->base = list;
+}
+
+
+static void
+restore_state ( state_t *st )
+{
+    n_virt = st->n_virt, n_pairs = st->n_pairs;
+    memcpy ( list, st->list, (n_field+n_virt+n_mirror) * sizeof(particle_t) );
+    memcpy ( pairs, st->pairs, n_pairs * sizeof(pair_t) );
+#if defined(BUCKET) && !defined(CSR_PAIRS)
+    // Ghost generation may have moved the list
+    if ( list != st->base )
+        for ( int_t kk=0; kk<n_pairs; kk++ )
+        {
+            pairs[kk].ip = list + (pairs[kk].ip - st->base);
+            pairs[kk].jp = list + (pairs[kk].jp - st->base);
+        }
+#endif //BUCKET
+#ifdef CSR_PAIRS
+    // A search may have left rows for pairs in another order
+    build_neighbor_lists ();
+#endif //CSR_PAIRS
+}
+
+
+/* Time one phase from the same input every repetition */
+static void
+measure ( const char *label, const phase_t *ph, state_t *st )
+{
+    double times[repetitions];
+    for ( int r=0; r<repetitions; r++ )
+    {
+        restore_state ( st );
+        double t = MPI_Wtime();
+        ph->phase ();
+        times[r] = MPI_Wtime() - t;
+    }
+    int_t found = n_pairs;
+    restore_state ( st );
+
+    double sum = 0.0, sum_sq = 0.0;
+    for ( int r=0; r<repetitions; r++ )
+        sum += times[r], sum_sq += times[r] * times[r];
+    double
+        mean = sum / repetitions,
+        std = sqrt ( MAX ( 0.0, sum_sq/repetitions - mean*mean ) );
+    qsort ( times, repetitions, sizeof(double), compare );
+    double median = times[repetitions/2];
+    // Neighbor searches are rated by the pairs they found
+    int_t items = ph->per_pair ? found : n_field;
+
+    printf ( "%-22s %7ld %8ld  %-26s %10.3lf %10.3lf %6.1lf%% "
+        "%9.3lf %s/s\n",
+        label, n_field, found, ph->name,
+        1e3*median, 1e3*times[0], 100.0 * std / MAX(mean,1e-12),
+        1e-6 * items / MAX(median,1e-12),
+        ph->per_pair ? "Mpairs" : "Mparticles"
+    );
+}
+
+
+/* Run the selected phases on the current working set */
+static void
+measure_phases ( const char *label )
+{
+    state_t st;
+    save_state ( &st );
+    printf ( "%-22s %7s %8s  %-26s %10s %10s %7s %9s\n",
+        "config", "field", "pairs", "phase", "median", "min", "std", "rate"
+    );
+    for ( size_t p=0; p<sizeof(phases)/sizeof(phases[0]); p++ )
+    {
+        if ( only_phase != NULL && strcmp ( only_phase, phases[p].name ) != 0 )
+            continue;
+        if ( phases[p].phase == find_neighbors
+            && (n_field+n_virt+n_mirror) > max_all_pairs )
+            continue;
+        measure ( label, &phases[p], &st );
+    }
+    free ( st.list );
+    free ( st.pairs );
+}
+
+
+int
+main ( int argc, char **argv )
+{
+    MPI_Init ( &argc, &argv );
+    MPI_Comm_rank ( comm, &rank );
+    MPI_Comm_size ( comm, &size );
+    if ( size != 1 )
+    {
+        if ( rank == 0 )
+            fprintf ( stderr, "Error: benchmarks run on a single rank\n" );
+        MPI_Abort ( comm, EINVAL );
+    }
+    east = west = 0;
+
+    int o;
+    while ( (o = getopt(argc,argv,"n:m:c:p:k:l:t:")) != -1 )
+    switch ( o )
+    {
+        case 'n':
+            repetitions = MAX ( 1, strtol(optarg,NULL,10) );
+            break;
+        case 'm':
+            max_all_pairs = strtol(optarg,NULL,10);
+            break;
+        case 'c':
+            only = optarg;
+            break;
+        case 'p':
+            only_phase = optarg;
+            break;
+        case 'k':
+            kernel_name = optarg;
+            break;
+        case 'l':
+            replay = optarg;
+            break;
+        case 't':
+            omp_set_num_threads ( MAX ( 1, strtol(optarg,NULL,10) ) );
+            break;
+    }
+
+#ifdef BUCKET
+    printf ( "Neighbor search: buckets, " );
+#else
+    printf ( "Neighbor search: all pairs, " );
+#endif //BUCKET
+    printf ( "%d threads, %d repetitions, times in ms (median, min, "
+        "rel. std)\n", omp_get_max_threads(), repetitions
+    );
+
+    if ( replay != NULL )
+    {
+        int_t step = load_snapshot ( replay );
+        find_near_wall ( 0.0 );
+        char label[64];
+        snprintf ( label, 64, "step %ld", step );
+        measure_phases ( label );
+    }
+    else
+    {
+        problem_t defaults = problem;
+        for ( size_t c=0; c<sizeof(configs)/sizeof(configs[0]); c++ )
+        {
+            if ( only != NULL && strcmp ( only, configs[c].name ) != 0 )
+                continue;
+            setup ( &configs[c], &defaults );
+            char label[64];
+            snprintf ( label, 64, "%s %.2lf %.4lf", configs[c].name,
+                configs[c].scale, configs[c].delta
+            );
+            measure_phases ( label );
+            finalize ();
+        }
+    }
+
+    MPI_Finalize();
+}
@@ -0,0 +1,188 @@
+#ifndef CONVERT_H
+#define CONVERT_H
+/* Shared by the converters (cp2txt, dat2txt): input files are mapped
+ * whole, records are formatted in blocks into large buffers by all
+ * threads and written in order, many files convert one per thread.
+ * The number formatting reproduces printf's "%ld" and "%e".
+ */
+#if __linux__ && !defined(_XOPEN_SOURCE)
+#define _XOPEN_SOURCE 500
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define CONVERT_BLOCK 65536     // Records per formatted block
+#define CONVERT_LINE 64         // Longest text line of one record
+
+/* Records inside [x0,x1] x [y0,y1] are kept, all when 'set' is false */
+typedef struct {
+    double x0, y0, x1, y1;
+    bool set;
+} region_t;
+
+
+/* Region from 'x0,y0,x1,y1', false if it does not parse */
+static inline bool
+parse_region ( const char *text, region_t *region )
+{
+    region->set = ( sscanf ( text, "%lf,%lf,%lf,%lf", &region->x0,
+        &region->y0, &region->x1, &region->y1 ) == 4 );
+    return region->set;
+}
+
+
+static inline bool
+in_region ( const region_t *region, double x, double y )
+{
+    return !region->set || ( x >= region->x0 && x <= region->x1
+        && y >= region->y0 && y <= region->y1 );
+}
+
+
+/* Decimal digits of v, at least 'width' of them ("%.<width>ld") */
+static inline char *
+format_int ( char *at, int64_t v, int width )
+{
+    char digits[24];
+    int n = 0;
+    uint64_t u = ( v < 0 ) ? -(uint64_t) v : (uint64_t) v;
+    do {
+        digits[n++] = '0' + u % 10;
+        u /= 10;
+    } while ( u > 0 );
+    while ( n < width )
+        digits[n++] = '0';
+    if ( v < 0 )
+        *at++ = '-';
+    while ( n > 0 )
+        *at++ = digits[--n];
+    return at;
+}
+
+
+/* v*10^k, exact powers of ten in long double up to 10^27 */
+static inline long double
+scale_pow10 ( double v, int k )
+{
+    static const long double pow10[28] = {
+        1e0L, 1e1L, 1e2L, 1e3L, 1e4L, 1e5L, 1e6L, 1e7L, 1e8L, 1e9L,
+        1e10L, 1e11L, 1e12L, 1e13L, 1e14L, 1e15L, 1e16L, 1e17L, 1e18L,
+        1e19L, 1e20L, 1e21L, 1e22L, 1e23L, 1e24L, 1e25L, 1e26L, 1e27L
+    };
+    return ( k >= 0 ) ? v * pow10[k] : v / pow10[-k];
+}
+
+
+/* printf's "%e": the seven significant digits come from one rounding
+ * in extended precision. Values out of that range, and those too close
+ * to halfway between two roundings to tell, go to sprintf.
+ */
+static inline char *
+format_exp ( char *at, double v )
+{
+    if ( !isfinite ( v ) || ( v != 0.0 && fabs ( v ) < 1e-20 )
+        || fabs ( v ) >= 1e20 )
+        return at + sprintf ( at, "%e", v );
+    if ( signbit ( v ) )
+    {
+        *at++ = '-';
+        v = -v;
+    }
+    int e = 0;
+    int64_t digits = 0;
+    if ( v != 0.0 )
+    {
+        e = (int) floor ( log10 ( v ) );
+        long double scaled = scale_pow10 ( v, 6-e );
+        /* log10 may be off by one next to powers of ten */
+        if ( scaled >= 9999999.5L )
+            scaled = scale_pow10 ( v, 6 - ++e );
+        else if ( scaled < 999999.5L )
+            scaled = scale_pow10 ( v, 6 - --e );
+        long double fraction = scaled - floorl ( scaled );
+        if ( fabsl ( fraction - 0.5L ) < 1e-6L )
+            return at + sprintf ( at, "%e", v );
+        digits = llrintl ( scaled );
+    }
+    char mantissa[8];
+    format_int ( mantissa, digits, 7 );
+    *at++ = mantissa[0];
+    *at++ = '.';
+    memcpy ( at, mantissa+1, 6 );
+    at += 6;
+    *at++ = 'e';
+    *at++ = ( e < 0 ) ? '-' : '+';
+    return format_int ( at, ( e < 0 ) ? -e : e, 2 );
+}
+
+
+/* Map a file for reading, NULL (and 0 bytes) if it is empty or fails */
+static inline const void *
+map_file ( const char *filename, size_t *bytes )
+{
+    struct stat file_stat;
+    void *data = NULL;
+    int fd = open ( filename, O_RDONLY );
+    *bytes = 0;
+    if ( fd < 0 )
+        return NULL;
+    if ( fstat ( fd, &file_stat ) == 0 && file_stat.st_size > 0 )
+    {
+        data = mmap ( NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+        if ( data == MAP_FAILED )
+            data = NULL;
+        else
+            *bytes = file_stat.st_size;
+    }
+    close ( fd );
+    return data;
+}
+
+
+/* 'plot/0012.dat' with a new extension, in 'name' of at least
+ * strlen(filename)+8 characters
+ */
+static inline void
+output_name ( char *name, const char *filename, const char *extension )
+{
+    strcpy ( name, filename );
+    char *dot = strrchr ( name, '.' ), *slash = strrchr ( name, '/' );
+    if ( dot == NULL || ( slash != NULL && slash > dot ) )
+        dot = name + strlen ( name );
+    strcpy ( dot, extension );
+}
+
+
+/* Format 'n' records in blocks, 'format' writes records [begin,end) to
+ * a buffer of CONVERT_BLOCK*CONVERT_LINE bytes and returns its end. The
+ * blocks are formatted by all threads and written to 'out' in order.
+ */
+static inline void
+convert_records ( size_t n, const void *records,
+    char *(*format) ( char *, const void *, size_t, size_t ), FILE *out )
+{
+    size_t n_blocks = ( n + CONVERT_BLOCK - 1 ) / CONVERT_BLOCK;
+    #pragma omp parallel
+    {
+        char *buffer = malloc ( CONVERT_BLOCK * CONVERT_LINE );
+        #pragma omp for ordered schedule(static,1)
+        for ( size_t b=0; b<n_blocks; b++ )
+        {
+            size_t begin = b * CONVERT_BLOCK,
+                end = ( begin + CONVERT_BLOCK < n ) ? begin + CONVERT_BLOCK : n;
+            char *stop = format ( buffer, records, begin, end );
+            #pragma omp ordered
+            fwrite ( buffer, 1, stop - buffer, out );
+        }
+        free ( buffer );
+    }
+}
+#endif //CONVERT_H
@@ -1,42 +1,117 @@
 #include "sph.h"
-#include <sys/stat.h>
+#include "convert.h"
 
+/* Checkpoints to text 'idx x y', or with -b to binary (idx, x, y) triples
+ * of real_t like the .dat files of dump_state. -r keeps the particles in
+ * a box. One file (-f) or several go to stdout, with -o each to a file
+ * next to its input (NNNN.txt, NNNN.pos), converted one per thread.
+ *
+ *   cp2txt [-b] [-o] [-r x0,y0,x1,y1] [-f file] [file...]
+ */
 void options ( int argc, char **argv );
-void generate_output ( FILE *in );
+int convert_file ( const char *name, FILE *out );
 
 
 char *filename = NULL;
-size_t filesize = 0;
-int_t n_field = 0;
-
+int first_file = 0, last_file = 0;
+region_t region = { .set = false };
 
 bool
+    binary = false,
+    beside = false,
     print_all = false;
 
 int
 main ( int argc, char **argv )
 {
     options ( argc, argv );
+    int failed = 0;
     if ( filename != NULL )
     {
-        FILE *in = fopen ( filename, "r" );
-        generate_output ( in );
-        fclose ( in );
+        failed += convert_file ( filename, stdout );
         free ( filename );
     }
-    exit ( EXIT_SUCCESS );
+    if ( !beside )
+        for ( int f=first_file; f<last_file; f++ )
+            failed += convert_file ( argv[f], stdout );
+    else
+    {
+        #pragma omp parallel for schedule(dynamic) reduction(+:failed)
+        for ( int f=first_file; f<last_file; f++ )
+        {
+            char name[strlen ( argv[f] ) + 8];
+            output_name ( name, argv[f], binary ? ".pos" : ".txt" );
+            FILE *out = fopen ( name, "wb" );
+            if ( out == NULL )
+            {
+                fprintf ( stderr, "%s: Could not write '%s'\n", argv[0], name );
+                failed += 1;
+                continue;
+            }
+            failed += convert_file ( argv[f], out );
+            fclose ( out );
+        }
+    }
+    exit ( failed ? EXIT_FAILURE : EXIT_SUCCESS );
 }
 
 
-void
-generate_output ( FILE *in )
+static char *
+format_text ( char *at, const void *records, size_t begin, size_t end )
+{
+    const particle_t *particles = records;
+    for ( size_t k=begin; k<end; k++ )
+    {
+        const particle_t *p = &particles[k];
+        if ( !in_region ( &region, p->x[0], p->x[1] ) )
+            continue;
+        at = format_int ( at, p->idx, 1 );
+        *at++ = ' ';
+        at = format_exp ( at, p->x[0] );
+        *at++ = ' ';
+        at = format_exp ( at, p->x[1] );
+        *at++ = '\n';
+    }
+    return at;
+}
+
+
+static char *
+format_binary ( char *at, const void *records, size_t begin, size_t end )
 {
-    for ( int p=0; p<n_field; p++ )
+    const particle_t *particles = records;
+    for ( size_t k=begin; k<end; k++ )
     {
-        particle_t p;
-        int readc = fread ( &p, sizeof(particle_t), 1, in );
-        printf ( "%ld %e %e\n", p.idx, p.x[0], p.x[1] );
+        const particle_t *p = &particles[k];
+        if ( !in_region ( &region, p->x[0], p->x[1] ) )
+            continue;
+        real_t triple[3] = { (real_t) p->idx, p->x[0], p->x[1] };
+        memcpy ( at, triple, sizeof(triple) );
+        at += sizeof(triple);
     }
+    return at;
+}
+
+
+int
+convert_file ( const char *name, FILE *out )
+{
+    size_t bytes;
+    const particle_t *particles = map_file ( name, &bytes );
+    if ( particles == NULL )
+    {
+        fprintf ( stderr, "cp2txt: Could not read file '%s'\n", name );
+        return 1;
+    }
+    if ( bytes % sizeof(particle_t) )
+        fprintf ( stderr, "cp2txt: Warning, file '%s' is not a multiple "
+            "of particle structure size\n", name
+        );
+    convert_records ( bytes / sizeof(particle_t), particles,
+        binary ? format_binary : format_text, out
+    );
+    munmap ( (void *) particles, bytes );
+    return 0;
 }
 
 
@@ -44,37 +119,29 @@ void
 options ( int argc, char **argv )
 {
     int o;
-    struct stat file_stat;
-    while ( (o = (getopt (argc, argv, "ahf:") )) != -1 )
+    while ( (o = (getopt (argc, argv, "ahbor:f:") )) != -1 )
     {
         switch (o)
         {
-            case 'h': printf ( "Help? This is help!\n" ); break;
+            case 'h':
+                printf ( "%s [-b] [-o] [-r x0,y0,x1,y1] [-f file] [file...]\n",
+                    argv[0]
+                );
+                break;
             case 'a': print_all = true; break;
-            case 'f':
-                filename = strdup ( optarg );
-                if ( stat ( filename, &file_stat ) )
+            case 'b': binary = true; break;
+            case 'o': beside = true; break;
+            case 'r':
+                if ( !parse_region ( optarg, &region ) )
                 {
-                    fprintf ( stderr, "%s: Could not stat file '%s'\n",
-                        argv[0], filename
-                    );
-                    free ( filename );
+                    fprintf ( stderr, "%s: Bad region '%s'\n", argv[0], optarg );
                     exit ( EXIT_FAILURE );
                 }
-                else
-                {
-                    filesize = file_stat.st_size;
-                    n_field = filesize / sizeof(particle_t);
-                    if ( filesize % sizeof(particle_t) )
-                    {
-                        fprintf ( stderr,
-                            "%s: Warning, file '%s' is not a multiple "
-                            "of particle structure size\n",
-                            argv[0], filename
-                        );
-                    }
-                }
+                break;
+            case 'f':
+                filename = strdup ( optarg );
                 break;
         }
     }
+    first_file = optind, last_file = argc;
 }
@@ -1,24 +1,115 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <stdint.h>
+#include "convert.h"
+#include <getopt.h>
 
 typedef int64_t int_t;
 typedef double real_t;
 
+/* dump_state output, (idx, x, y) triples of real_t, to text, or with -b
+ * to triples again. -r keeps the triples in a box. Files go to stdout,
+ * with -o each to a file next to its input (.txt, .pos), converted one
+ * per thread.
+ *
+ *   dat2txt [-b] [-o] [-r x0,y0,x1,y1] file...
+ */
+static region_t region = { .set = false };
+
+
+static char *
+format_text ( char *at, const void *records, size_t begin, size_t end )
+{
+    const real_t (*triple)[3] = records;
+    for ( size_t k=begin; k<end; k++ )
+    {
+        if ( !in_region ( &region, triple[k][1], triple[k][2] ) )
+            continue;
+        at = format_int ( at, (int_t) triple[k][0], 5 );
+        *at++ = ' ';
+        at = format_exp ( at, triple[k][1] );
+        *at++ = ' ';
+        at = format_exp ( at, triple[k][2] );
+        *at++ = '\n';
+    }
+    return at;
+}
+
+
+static char *
+format_binary ( char *at, const void *records, size_t begin, size_t end )
+{
+    const real_t (*triple)[3] = records;
+    for ( size_t k=begin; k<end; k++ )
+        if ( in_region ( &region, triple[k][1], triple[k][2] ) )
+        {
+            memcpy ( at, triple[k], sizeof(triple[k]) );
+            at += sizeof(triple[k]);
+        }
+    return at;
+}
+
+
+static int
+convert_file ( const char *name, FILE *out, bool binary )
+{
+    size_t bytes;
+    const void *triples = map_file ( name, &bytes );
+    if ( triples == NULL )
+    {
+        fprintf ( stderr, "dat2txt: Could not read file '%s'\n", name );
+        return 1;
+    }
+    convert_records ( bytes / (3*sizeof(real_t)), triples,
+        binary ? format_binary : format_text, out
+    );
+    munmap ( (void *) triples, bytes );
+    return 0;
+}
+
+
 int
 main ( int argc, char **argv )
 {
-    if ( argc < 2 )
+    bool binary = false, beside = false;
+    int o, failed = 0;
+    while ( (o = getopt ( argc, argv, "bor:" )) != -1 )
+        switch ( o )
+        {
+            case 'b': binary = true; break;
+            case 'o': beside = true; break;
+            case 'r':
+                if ( !parse_region ( optarg, &region ) )
+                {
+                    fprintf ( stderr, "Bad region '%s'\n", optarg );
+                    exit ( EXIT_FAILURE );
+                }
+                break;
+            default: exit ( EXIT_FAILURE );
+        }
+    if ( optind >= argc )
     {
         fprintf ( stderr, "No file name\n" );
         exit ( EXIT_FAILURE );
     }
-    FILE *in = fopen ( argv[1], "r" );
-    real_t triple[3];
-    while ( fread ( triple, sizeof(real_t), 3, in ) && !feof(in) )
+
+    if ( !beside )
+        for ( int f=optind; f<argc; f++ )
+            failed += convert_file ( argv[f], stdout, binary );
+    else
     {
-        int_t idx = (int_t) triple[0];
-        printf ( "%.5ld %e %e\n", idx, triple[1], triple[2] );
+        #pragma omp parallel for schedule(dynamic) reduction(+:failed)
+        for ( int f=optind; f<argc; f++ )
+        {
+            char name[strlen ( argv[f] ) + 8];
+            output_name ( name, argv[f], binary ? ".pos" : ".txt" );
+            FILE *out = fopen ( name, "wb" );
+            if ( out == NULL )
+            {
+                fprintf ( stderr, "Could not write '%s'\n", name );
+                failed += 1;
+                continue;
+            }
+            failed += convert_file ( argv[f], out, binary );
+            fclose ( out );
+        }
     }
-    fclose ( in );
+    exit ( failed ? EXIT_FAILURE : EXIT_SUCCESS );
 }
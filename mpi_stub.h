@@ -0,0 +1,156 @@
+#ifndef MPI_STUB_H
+#define MPI_STUB_H
+/* Just enough of MPI for one process, used by the -DNO_MPI build (make
+ * sph_omp). The world is rank 0 of size 1: collectives copy, exchanges
+ * with oneself copy, point-to-point messages have no peer.
+ *
+ * Datatypes are their size in bytes, which is all copying needs.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <omp.h>
+
+#if defined(WITH_SHM) || defined(WITH_MPIIO)
+#error "NO_MPI can not be combined with WITH_SHM or WITH_MPIIO"
+#endif
+
+typedef int MPI_Comm;
+typedef int MPI_Datatype;
+typedef int MPI_Op;
+typedef int MPI_Request;
+typedef int MPI_Info;
+typedef struct { int MPI_SOURCE, MPI_TAG, MPI_ERROR; } MPI_Status;
+
+#define MPI_COMM_WORLD 0
+#define MPI_COMM_SELF 1
+#define MPI_COMM_NULL (-1)
+#define MPI_COMM_TYPE_SHARED 0
+#define MPI_INFO_NULL 0
+#define MPI_SUCCESS 0
+#define MPI_PROC_NULL (-2)
+#define MPI_ANY_SOURCE (-1)
+#define MPI_STATUS_IGNORE ((MPI_Status *)NULL)
+#define MPI_STATUSES_IGNORE ((MPI_Status *)NULL)
+
+#define MPI_BYTE ((MPI_Datatype)1)
+#define MPI_CHAR ((MPI_Datatype)sizeof(char))
+#define MPI_C_BOOL ((MPI_Datatype)sizeof(_Bool))
+#define MPI_INT ((MPI_Datatype)sizeof(int))
+#define MPI_LONG ((MPI_Datatype)sizeof(long))
+#define MPI_FLOAT ((MPI_Datatype)sizeof(float))
+#define MPI_DOUBLE ((MPI_Datatype)sizeof(double))
+
+#define MPI_MAX 0
+#define MPI_MIN 1
+#define MPI_SUM 2
+
+
+static inline int MPI_Init ( int *argc, char ***argv )
+{ (void)argc, (void)argv; return MPI_SUCCESS; }
+
+static inline int MPI_Finalize ( void )
+{ return MPI_SUCCESS; }
+
+static inline int MPI_Comm_rank ( MPI_Comm comm, int *rank )
+{ (void)comm; *rank = 0; return MPI_SUCCESS; }
+
+static inline int MPI_Comm_size ( MPI_Comm comm, int *size )
+{ (void)comm; *size = 1; return MPI_SUCCESS; }
+
+static inline int MPI_Comm_split ( MPI_Comm comm, int color, int key,
+    MPI_Comm *newcomm )
+{ (void)color, (void)key; *newcomm = comm; return MPI_SUCCESS; }
+
+static inline int MPI_Comm_split_type ( MPI_Comm comm, int split_type,
+    int key, MPI_Info info, MPI_Comm *newcomm )
+{ (void)split_type, (void)key, (void)info; *newcomm = comm;
+  return MPI_SUCCESS; }
+
+static inline int MPI_Comm_free ( MPI_Comm *comm )
+{ *comm = MPI_COMM_WORLD; return MPI_SUCCESS; }
+
+static inline int MPI_Abort ( MPI_Comm comm, int errorcode )
+{ (void)comm; exit ( errorcode ); }
+
+static inline double MPI_Wtime ( void )
+{ return omp_get_wtime(); }
+
+static inline int MPI_Barrier ( MPI_Comm comm )
+{ (void)comm; return MPI_SUCCESS; }
+
+static inline int MPI_Bcast ( void *buffer, int count, MPI_Datatype type,
+    int root, MPI_Comm comm )
+{ (void)buffer, (void)count, (void)type, (void)root, (void)comm;
+  return MPI_SUCCESS; }
+
+static inline int MPI_Allreduce ( const void *sendbuf, void *recvbuf,
+    int count, MPI_Datatype type, MPI_Op op, MPI_Comm comm )
+{ (void)op, (void)comm;
+  memmove ( recvbuf, sendbuf, (size_t)count * type ); return MPI_SUCCESS; }
+
+static inline int MPI_Reduce ( const void *sendbuf, void *recvbuf,
+    int count, MPI_Datatype type, MPI_Op op, int root, MPI_Comm comm )
+{ (void)op, (void)root, (void)comm;
+  memmove ( recvbuf, sendbuf, (size_t)count * type ); return MPI_SUCCESS; }
+
+static inline int MPI_Gather ( const void *sendbuf, int sendcount,
+    MPI_Datatype sendtype, void *recvbuf, int recvcount,
+    MPI_Datatype recvtype, int root, MPI_Comm comm )
+{ (void)recvcount, (void)recvtype, (void)root, (void)comm;
+  memmove ( recvbuf, sendbuf, (size_t)sendcount * sendtype );
+  return MPI_SUCCESS; }
+
+static inline int MPI_Gatherv ( const void *sendbuf, int sendcount,
+    MPI_Datatype sendtype, void *recvbuf, const int *recvcounts,
+    const int *displs, MPI_Datatype recvtype, int root, MPI_Comm comm )
+{ (void)recvcounts, (void)displs, (void)recvtype, (void)root, (void)comm;
+  memmove ( recvbuf, sendbuf, (size_t)sendcount * sendtype );
+  return MPI_SUCCESS; }
+
+static inline int MPI_Allgather ( const void *sendbuf, int sendcount,
+    MPI_Datatype sendtype, void *recvbuf, int recvcount,
+    MPI_Datatype recvtype, MPI_Comm comm )
+{ (void)recvcount, (void)recvtype, (void)comm;
+  memmove ( recvbuf, sendbuf, (size_t)sendcount * sendtype );
+  return MPI_SUCCESS; }
+
+/* Derived types are contiguous runs, their size is all that counts */
+static inline int MPI_Type_contiguous ( int count, MPI_Datatype oldtype,
+    MPI_Datatype *newtype )
+{ *newtype = count * oldtype; return MPI_SUCCESS; }
+
+static inline int MPI_Type_commit ( MPI_Datatype *type )
+{ (void)type; return MPI_SUCCESS; }
+
+static inline int MPI_Type_free ( MPI_Datatype *type )
+{ (void)type; return MPI_SUCCESS; }
+
+static inline int MPI_Sendrecv ( const void *sendbuf, int sendcount,
+    MPI_Datatype sendtype, int dest, int sendtag, void *recvbuf,
+    int recvcount, MPI_Datatype recvtype, int source, int recvtag,
+    MPI_Comm comm, MPI_Status *status )
+{ (void)dest, (void)sendtag, (void)recvcount, (void)recvtype, (void)source,
+  (void)recvtag, (void)comm, (void)status;
+  memmove ( recvbuf, sendbuf, (size_t)sendcount * sendtype );
+  return MPI_SUCCESS; }
+
+/* A lone process has nobody to message */
+static inline int mpi_stub_no_peer ( const char *call )
+{ fprintf ( stderr, "Error: %s without MPI, aborting\n", call ); exit ( 1 ); }
+
+static inline int MPI_Send ( const void *buf, int count, MPI_Datatype type,
+    int dest, int tag, MPI_Comm comm )
+{ (void)buf, (void)count, (void)type, (void)dest, (void)tag, (void)comm;
+  return mpi_stub_no_peer ( "MPI_Send" ); }
+
+static inline int MPI_Ssend ( const void *buf, int count, MPI_Datatype type,
+    int dest, int tag, MPI_Comm comm )
+{ (void)buf, (void)count, (void)type, (void)dest, (void)tag, (void)comm;
+  return mpi_stub_no_peer ( "MPI_Ssend" ); }
+
+static inline int MPI_Recv ( void *buf, int count, MPI_Datatype type,
+    int source, int tag, MPI_Comm comm, MPI_Status *status )
+{ (void)buf, (void)count, (void)type, (void)source, (void)tag, (void)comm,
+  (void)status; return mpi_stub_no_peer ( "MPI_Recv" ); }
+#endif //MPI_STUB_H
@@ -0,0 +1,150 @@
+#include "sph.h"
+#include <errno.h>
+#include <sys/stat.h>
+
+/* Frames of checkpoint files, drawn in parallel one file per thread and
+ * written next to them as NNNN.png (NNNN.ppm). Built with the solver's
+ * flags, checkpoints are the particles as the solver stores them, in one
+ * file or in the subfiles of its index (-M). The tank is that of the run,
+ * given with the solver's '-p' and '-f' settings.
+ *
+ *   raster [-g field[:ppm]] [-f file] [-p key=value]... [-s scale]
+ *       [-w width] file...
+ */
+void options ( int argc, char **argv );
+int draw_frame ( const char *filename, float *grid, particle_t **particles,
+    size_t *capacity );
+
+
+char *spec = "dots";
+int width = 1200, first_file = 1;
+raster_t raster;
+
+
+int
+main ( int argc, char **argv )
+{
+    options ( argc, argv );
+    int n_files = argc - first_file, failed = 0;
+
+    #pragma omp parallel reduction(+:failed)
+    {
+        float *grid = malloc ( (size_t) raster.width * raster.height
+            * sizeof(float)
+        );
+        particle_t *particles = NULL;
+        size_t capacity = 0;
+        #pragma omp for schedule(dynamic)
+        for ( int f=0; f<n_files; f++ )
+            failed += draw_frame ( argv[first_file+f], grid, &particles,
+                &capacity
+            );
+        free ( particles );
+        free ( grid );
+    }
+    exit ( failed ? EXIT_FAILURE : EXIT_SUCCESS );
+}
+
+
+/* Read one checkpoint whole and write its frame, nonzero on failure */
+int
+draw_frame ( const char *filename, float *grid, particle_t **particles,
+    size_t *capacity )
+{
+    char (*parts)[256];
+    int n_parts = aggregate_parts ( filename, &parts );
+    if ( n_parts == 0 )
+    {
+        fprintf ( stderr, "raster: Could not read file '%s'\n", filename );
+        return 1;
+    }
+
+    /* The parts in idx order are the checkpoint */
+    size_t n = 0;
+    for ( int f=0; f<n_parts; f++ )
+    {
+        struct stat file_stat;
+        FILE *in = fopen ( parts[f], "rb" );
+        if ( in == NULL || fstat ( fileno ( in ), &file_stat ) != 0 )
+        {
+            fprintf ( stderr, "raster: Could not read file '%s'\n",
+                parts[f]
+            );
+            if ( in != NULL )
+                fclose ( in );
+            free ( parts );
+            return 1;
+        }
+        size_t n_part = file_stat.st_size / sizeof(particle_t);
+        if ( file_stat.st_size % sizeof(particle_t) )
+            fprintf ( stderr, "raster: Warning, file '%s' is not a multiple "
+                "of particle structure size\n", parts[f]
+            );
+        if ( n + n_part > *capacity )
+        {
+            *capacity = MAX ( n + n_part, 2 * *capacity );
+            *particles = realloc ( *particles,
+                *capacity * sizeof(particle_t)
+            );
+        }
+        n += fread ( *particles + n, sizeof(particle_t), n_part, in );
+        fclose ( in );
+    }
+    free ( parts );
+
+    /* plot/0012.dat becomes plot/0012.png */
+    char out[strlen ( filename ) + 5];
+    strcpy ( out, filename );
+    char *dot = strrchr ( out, '.' );
+    if ( dot == NULL || strchr ( dot, '/' ) != NULL )
+        dot = out + strlen ( out );
+    strcpy ( dot, raster.ppm ? ".ppm" : ".png" );
+
+    raster_splat ( &raster, *particles, n, grid );
+    int status = raster_write ( &raster, grid, out );
+    if ( status != 0 )
+        fprintf ( stderr, "raster: Cannot write '%s': %s\n",
+            out, strerror ( status )
+        );
+    return ( status != 0 );
+}
+
+
+void
+options ( int argc, char **argv )
+{
+    char *settings[argc], *filename = NULL, scale[64];
+    int o, n_settings = 0;
+    while ( (o = (getopt (argc, argv, "hf:g:p:s:w:") )) != -1 )
+    {
+        switch (o)
+        {
+            case 'h':
+                printf ( "%s [-g dots|pressure|speed[:ppm]] [-f file] "
+                    "[-p key=value]... [-s scale] [-w width] file...\n",
+                    argv[0]
+                );
+                exit ( EXIT_SUCCESS );
+            case 'f': filename = optarg; break;
+            case 'g': spec = optarg; break;
+            case 'p': settings[n_settings++] = optarg; break;
+            case 's':   // Short for '-p scale=...'
+                snprintf ( scale, sizeof(scale), "scale=%s", optarg );
+                settings[n_settings++] = scale;
+                break;
+            case 'w': width = strtol ( optarg, NULL, 10 ); break;
+        }
+    }
+    /* The tank of the run, as the solver derives it */
+    if ( problem_read ( filename, settings, n_settings ) != 0 )
+        exit ( EXIT_FAILURE );
+    problem_derive ();
+    if ( !raster_setup ( &raster, spec, width, B, T, DELTA ) )
+    {
+        fprintf ( stderr, "%s: Bad frame '%s' or width %d\n",
+            argv[0], spec, width
+        );
+        exit ( EXIT_FAILURE );
+    }
+    first_file = optind;
+}
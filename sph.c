@@ -1,14 +1,19 @@
 #include "sph.h"
+#include <errno.h>
+#include <sys/stat.h>
 
 #define CAP_INCREMENT 4096
 
 bool verbose = false, restart = false;
 int size, rank, west, east;
+MPI_Comm comm = MPI_COMM_WORLD;     // One ensemble member, or everyone
+char output_dir[128] = "plot";
 real_t subdomain[2];
 int_t n_field = 0,
         n_virt = 0,
         n_mirror = 0,
         n_pairs = 0,
+        n_halo = 0,
         n_global_field = 0;
 
 /* Timing */
@@ -25,7 +30,64 @@ double
 int_t
     min_iteration = MIN_ITERATION_DEFAULT,
     max_iteration = MAX_ITERATION_DEFAULT,
-    checkpoint_frequency = CHECKPOINT_FREQUENCY_DEFAULT;
+    checkpoint_frequency = CHECKPOINT_FREQUENCY_DEFAULT,
+    halo_depth_max = HALO_DEPTH_DEFAULT,
+    halo_depth = 1,
+    snapshot_step = -1;     // Dump the working set at this step (-s)
+
+/* Views written every view_frequency steps (-v), what they hold (-o) */
+int_t view_frequency = 0;
+view_t view = {
+    .box = { -INFINITY, -INFINITY, INFINITY, INFINITY },
+    .stride = 1,
+    .fields = VIEW_IDX | VIEW_X
+};
+
+/* Frames drawn at output steps (-g), off while width is 0 */
+raster_t frame = { .width = 0 };
+#define FRAME_WIDTH 1200
+
+#ifdef BLOCK_STEP
+/* Per-particle activity in the current step, and how many of the
+ * integrated particles were active over the run
+ */
+bool *active = NULL;
+int *wake = NULL;       // Levels active neighbors allow, one bit each
+int_t
+    n_active_cap = 0,
+    n_active_updates = 0,
+    n_real_updates = 0;
+#endif //BLOCK_STEP
+
+/* Time step, adapted to the flow when courant > 0 */
+real_t
+    dt = DT_DEFAULT,
+    courant = 0.0,
+    t_sim = 0.0;
+
+/* Deep halos: mirrors out to halo_width are integrated redundantly for
+ * halo_depth steps between exchanges, halo_reach bounds halo_width.
+ * Particles move at most halo_drift meanwhile.
+ */
+real_t halo_width, halo_reach, halo_drift = 0.0;
+
+/* List indices of the particles that can get ghosts before a deep halo
+ * list is rebuilt, found by find_near_wall()
+ */
+int_t *near_wall = NULL, n_near_wall = 0, n_near_wall_cap = 0;
+
+/* Per-thread counts of compact_offset() */
+static int_t *compact_counts = NULL;
+static int n_compact_counts = 0;
+
+#ifndef NO_MPI
+/* Halo export of halo_select(), and per-thread blocks of what it found */
+static int_t
+    *halo_index = NULL,
+    *halo_scratch = NULL,
+    n_halo_index = 0,
+    n_halo_index_cap = 0;
+#endif //NO_MPI
 
 particle_t *list;                   // Flat list of particle structs
 int_t n_capacity = CAP_INCREMENT;   // Initial list capacity, grows
@@ -33,7 +95,31 @@ int_t n_capacity = CAP_INCREMENT;   // Initial list capacity, grows
 pair_t *pairs;
 int_t n_pair_cap = CAP_INCREMENT;
 
-bucket_t** buckets;
+#ifdef CSR_PAIRS
+neighbor_t *neighbors = NULL;       // Rows of all particles, back to back
+pair_value_t *pair_values = NULL;   // Kernel values by pair
+int_t
+    *neighbor_offset = NULL,        // Row k is [neighbor_offset[k],[k+1])
+    *row_end = NULL,                // Fill position per row
+    n_neighbor_cap = 0,
+    n_offset_cap = 0;
+#endif //CSR_PAIRS
+
+#ifdef BUCKET
+/* Occupied buckets in a hash table, and chains of their particles */
+bucket_t *buckets = NULL;
+int_t
+    n_bucket_slots = 0,                 // Hash table size, a power of two
+    n_bucket_cap = 0,                   // Particles the arrays below hold
+    n_occupied = 0,
+    *occupied_buckets = NULL,           // Slots in use, compact
+    *next_in_bucket = NULL;             // Next particle in the bucket, -1 ends
+#ifdef FILL_BUCKETS_LOCK
+omp_lock_t *bucket_locks = NULL;        // One per slot
+#endif //FILL_BUCKETS_LOCK
+pair_buffer_t *pair_buffers = NULL;     // One per thread
+int n_pair_buffers = 0;
+#endif //BUCKET
 
 void print_timing(char* full_string, char* short_string, double value) {
     if (rank == 0) {
@@ -42,16 +128,16 @@ void print_timing(char* full_string, char* short_string, double value) {
             size_t remote_string_size = strlen(short_string);
             char remote_string[remote_string_size];
             double remote_value = 0.0;
-            MPI_Recv(remote_string, remote_string_size+1, MPI_CHAR, r, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-            MPI_Recv(&remote_value, 1, MPI_DOUBLE, r, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+            MPI_Recv(remote_string, remote_string_size+1, MPI_CHAR, r, 0, comm, MPI_STATUS_IGNORE);
+            MPI_Recv(&remote_value, 1, MPI_DOUBLE, r, 0, comm, MPI_STATUS_IGNORE);
             printf(remote_string, remote_value);
         }
         printf("\n");
     }
     else {
         size_t string_size = strlen(short_string);
-        MPI_Send(short_string, string_size+1, MPI_CHAR, 0, 0, MPI_COMM_WORLD);
-        MPI_Send(&value, 1, MPI_DOUBLE, 0, 0, MPI_COMM_WORLD);
+        MPI_Send(short_string, string_size+1, MPI_CHAR, 0, 0, comm);
+        MPI_Send(&value, 1, MPI_DOUBLE, 0, 0, comm);
     }
 }
 
@@ -59,7 +145,7 @@ void
 ext_force ( void )
 {
     #pragma omp parallel for
-    for ( int_t k=0; k<n_field; k++ )
+    for ( int_t k=0; k<(n_field+n_halo); k++ )
         EXDVXDT(k,1) = -9.81;
 }
 
@@ -69,24 +155,53 @@ int_force ( void )
 {
 #pragma omp parallel
     {
-
+        TRACE_BEGIN ( reset );
         #pragma omp for nowait
         for (int_t k = 0; k < (n_field + n_virt + n_mirror); k++)
-            INDVXDT(k, 0) = INDVXDT(k, 1) = 0.0;
+            if (ACTIVE(k))
+                INDVXDT(k, 0) = INDVXDT(k, 1) = 0.0;
 
 
-        #pragma omp for
-        for (int_t k = 0; k < n_field; k++)
-            if (INTER(k) < free_surface)
+        #pragma omp for nowait
+        for (int_t k = 0; k < (n_field + n_halo); k++)
+            if (INTER(k) < free_surface && ACTIVE(k))
                 RHO(k) = density;
+        TRACE_END ( reset, "int_force reset" );
+        TRACE_BARRIER ();
 
         // Equations of state
-        #pragma omp for
+        TRACE_BEGIN ( state );
+        #pragma omp for nowait
         for (int_t k = 0; k < (n_field + n_virt + n_mirror); k++)
             P(k) = sos * sos * density * ((pow(RHO(k) / density, 7.0) - 1.0) / 7.0);
+        TRACE_END ( state, "int_force state" );
+        TRACE_BARRIER ();
 
         // All the pairwise interactions
-        #pragma omp  for
+        TRACE_BEGIN ( interact );
+#ifdef CSR_PAIRS
+        #pragma omp for nowait
+        for (int_t i = 0; i < (n_field + n_virt + n_mirror); i++) {
+            if (!ACTIVE(i))
+                continue;
+            real_t ax = 0.0, ay = 0.0;
+
+            // Neighbors act on i, reverse sign where dwdx is X(j)-X(i)
+            for (int_t e = neighbor_offset[i]; e < neighbor_offset[i+1]; e++) {
+                int_t j = neighbors[e].j;
+                pair_value_t *v = &pair_values[neighbors[e].pair];
+                real_t sign = (i < j) ? 1.0 : -1.0;
+                real_t hx, hy;
+                hx = -(P(i) / pow(RHO(i), 2) + P(j) / pow(RHO(j), 2)) * (sign * v->dwdx[0]);
+                hy = -(P(i) / pow(RHO(i), 2) + P(j) / pow(RHO(j), 2)) * (sign * v->dwdx[1]);
+                ax += M(j) * hx;
+                ay += M(j) * hy;
+            }
+            INDVXDT(i, 0) += ax;
+            INDVXDT(i, 1) += ay;
+        }
+#else
+        #pragma omp for nowait
         for (int_t kk = 0; kk < n_pairs; kk++) {
             int_t
                     i = pairs[kk].i,
@@ -94,21 +209,28 @@ int_force ( void )
             real_t hx, hy;
 
             // i acts on j
-            hx = -(P(i) / pow(RHO(i), 2) + P(j) / pow(RHO(j), 2)) * pairs[kk].dwdx[0];
-            hy = -(P(i) / pow(RHO(i), 2) + P(j) / pow(RHO(j), 2)) * pairs[kk].dwdx[1];
-            #pragma omp atomic
-            INDVXDT(i, 0) += M(j) * hx;
-            #pragma omp atomic
-            INDVXDT(i, 1) += M(j) * hy;
+            if (ACTIVE(i)) {
+                hx = -(P(i) / pow(RHO(i), 2) + P(j) / pow(RHO(j), 2)) * pairs[kk].dwdx[0];
+                hy = -(P(i) / pow(RHO(i), 2) + P(j) / pow(RHO(j), 2)) * pairs[kk].dwdx[1];
+                #pragma omp atomic
+                INDVXDT(i, 0) += M(j) * hx;
+                #pragma omp atomic
+                INDVXDT(i, 1) += M(j) * hy;
+            }
 
             // j acts on i, reverse sign because dwdx is X(i)-X(j)
-            hx = -(P(j) / pow(RHO(j), 2) + P(i) / pow(RHO(i), 2)) * (-pairs[kk].dwdx[0]);
-            hy = -(P(j) / pow(RHO(j), 2) + P(i) / pow(RHO(i), 2)) * (-pairs[kk].dwdx[1]);
-            #pragma omp atomic
-            INDVXDT(j, 0) += M(i) * hx;
-            #pragma omp atomic
-            INDVXDT(j, 1) += M(i) * hy;
+            if (ACTIVE(j)) {
+                hx = -(P(j) / pow(RHO(j), 2) + P(i) / pow(RHO(i), 2)) * (-pairs[kk].dwdx[0]);
+                hy = -(P(j) / pow(RHO(j), 2) + P(i) / pow(RHO(i), 2)) * (-pairs[kk].dwdx[1]);
+                #pragma omp atomic
+                INDVXDT(j, 0) += M(i) * hx;
+                #pragma omp atomic
+                INDVXDT(j, 1) += M(i) * hy;
+            }
         }
+#endif //CSR_PAIRS
+        TRACE_END ( interact, "int_force pairs" );
+        TRACE_BARRIER ();
     }
 
 }
@@ -119,27 +241,51 @@ correction ( void )
 {
     #pragma omp parallel
     {
-        #pragma omp for
+        TRACE_BEGIN ( interact );
+#ifdef CSR_PAIRS
+        #pragma omp for nowait
+        for (int_t i = 0; i < (n_field + n_virt + n_mirror); i++) {
+            if (!ACTIVE(i))
+                continue;
+            real_t avrho = 0.0;
+            for (int_t e = neighbor_offset[i]; e < neighbor_offset[i+1]; e++) {
+                real_t drho = RHO(i) - RHO(neighbors[e].j);
+                avrho -= drho * pair_values[neighbors[e].pair].w / WSUM(i);
+            }
+            AVRHO(i) += avrho;
+        }
+#else
+        #pragma omp for nowait
         for (int_t kk = 0; kk < n_pairs; kk++) {
             int_t
                     i = pairs[kk].i,
                     j = pairs[kk].j;
             real_t drho;
-            drho = RHO(i) - RHO(j);
-            #pragma omp atomic
-            AVRHO(i) -= drho * pairs[kk].w / WSUM(i);
-            drho = RHO(j) - RHO(i);
-            #pragma omp atomic
-            AVRHO(j) -= drho * pairs[kk].w / WSUM(j);
+            if (ACTIVE(i)) {
+                drho = RHO(i) - RHO(j);
+                #pragma omp atomic
+                AVRHO(i) -= drho * pairs[kk].w / WSUM(i);
+            }
+            if (ACTIVE(j)) {
+                drho = RHO(j) - RHO(i);
+                #pragma omp atomic
+                AVRHO(j) -= drho * pairs[kk].w / WSUM(j);
+            }
         }
+#endif //CSR_PAIRS
+        TRACE_END ( interact, "correction pairs" );
+        TRACE_BARRIER ();
 
-        #pragma omp for
+        TRACE_BEGIN ( update );
+        #pragma omp for nowait
         for (int_t k = 0; k < (n_field + n_virt + n_mirror); k++) {
             if (TYPE(k) < 0 && INTER(k) < 10)
                 RHO(k) = density;
             else
                 RHO(k) += 0.5 * AVRHO(k);
         }
+        TRACE_END ( update, "correction update" );
+        TRACE_BARRIER ();
     }
 }
 
@@ -147,94 +293,348 @@ correction ( void )
 void
 cont_density ( void )
 {
+    // Inactive particles keep their last rate as prediction
     for ( int_t k=0; k<(n_field+n_virt+n_mirror); k++ )
-        DRHODT(k) = 0.0;
+        if ( ACTIVE(k) )
+            DRHODT(k) = 0.0;
 
-    #pragma omp parallel for
-    for ( int_t kk=0; kk<n_pairs; kk++ )
+    #pragma omp parallel
     {
-        int_t
-            i = pairs[kk].i,
-            j = pairs[kk].j;
-        real_t vcc;
+        TRACE_BEGIN ( interact );
+#ifdef CSR_PAIRS
+        #pragma omp for nowait
+        for ( int_t i=0; i<(n_field+n_virt+n_mirror); i++ )
+        {
+            if ( !ACTIVE(i) )
+                continue;
+            real_t drhodt = 0.0;
+            for ( int_t e=neighbor_offset[i]; e<neighbor_offset[i+1]; e++ )
+            {
+                int_t j = neighbors[e].j;
+                pair_value_t *v = &pair_values[neighbors[e].pair];
+                real_t sign = ( i < j ) ? 1.0 : -1.0;
+                real_t vcc = (VX(i)-VX(j))*(sign*v->dwdx[0]) +
+                             (VY(i)-VY(j))*(sign*v->dwdx[1]);
+                drhodt += RHO(i) * (M(j)/RHO(j)) * vcc;
+            }
+            DRHODT(i) += drhodt;
+        }
+#else
+        #pragma omp for nowait
+        for ( int_t kk=0; kk<n_pairs; kk++ )
+        {
+            int_t
+                i = pairs[kk].i,
+                j = pairs[kk].j;
+            real_t vcc;
 
-        vcc = (VX(i)-VX(j))*pairs[kk].dwdx[0] +
-              (VY(i)-VY(j))*pairs[kk].dwdx[1];
-        #pragma omp atomic
-        DRHODT(i) += RHO(i) * (M(j)/RHO(j)) * vcc;
+            if ( ACTIVE(i) )
+            {
+                vcc = (VX(i)-VX(j))*pairs[kk].dwdx[0] +
+                      (VY(i)-VY(j))*pairs[kk].dwdx[1];
+                #pragma omp atomic
+                DRHODT(i) += RHO(i) * (M(j)/RHO(j)) * vcc;
+            }
 
-        // Reverse sign of dwdx because it is calc. with X(i)-X(j)
-        vcc = (VX(j)-VX(i))*(-pairs[kk].dwdx[0]) +
-              (VY(j)-VY(i))*(-pairs[kk].dwdx[1]);
-        #pragma omp atomic
-        DRHODT(j) += RHO(j) * (M(i)/RHO(i)) * vcc;
+            // Reverse sign of dwdx because it is calc. with X(i)-X(j)
+            if ( ACTIVE(j) )
+            {
+                vcc = (VX(j)-VX(i))*(-pairs[kk].dwdx[0]) +
+                      (VY(j)-VY(i))*(-pairs[kk].dwdx[1]);
+                #pragma omp atomic
+                DRHODT(j) += RHO(j) * (M(i)/RHO(i)) * vcc;
+            }
+        }
+#endif //CSR_PAIRS
+        TRACE_END ( interact, "cont_density pairs" );
+        TRACE_BARRIER ();
+
+        TRACE_BEGIN ( update );
+        #pragma omp for nowait
+        for ( int_t k=0; k<(n_field+n_virt+n_mirror); k++ )
+        {
+            RHO(k) += 0.5 * dt * DRHODT(k);
+        }
+        TRACE_END ( update, "cont_density update" );
+        TRACE_BARRIER ();
     }
+}
 
-    #pragma omp parallel for
-    for ( int_t k=0; k<(n_field+n_virt+n_mirror); k++ )
+
+/* Smoothing kernels: w and its gradient dwdx at distance r = q*H along
+ * dx = X(i)-X(j), 'factor' is the normalization over H^2. Each kernel
+ * gets a pair loop of its own (KERNEL_PAIRS), with the kernel inlined.
+ * Their names, supports and normalizations are in kernels[].
+ */
+
+/* Quintic spline */
+static inline void
+kernel_quintic ( real_t factor, real_t q, real_t r, const real_t dx[2],
+    real_t *w, real_t dwdx[2] )
+{
+    if ( q == 0.0 )
+    {
+        *w = factor * (
+            pow((3-q),5) - 6*pow((2-q),5) + 15*pow((1-q),5)
+        );
+        dwdx[0] = dwdx[1] = 0.0;
+    }
+    else if ( q>0.0 && q<=1.0 )
+    {
+        *w = factor * (
+            pow((3-q),5) - 6*pow((2-q),5) + 15*pow((1-q),5)
+        );
+        dwdx[0] = (factor/pow(H,2)) *
+            (-120+120*pow(q,2)-50*pow(q,3))*dx[0];
+        dwdx[1] = (factor/pow(H,2)) *
+            (-120+120*pow(q,2)-50*pow(q,3))*dx[1];
+    }
+    else if ( q>1.0 && q<=2.0 )
     {
-        RHO(k) += 0.5 * dt * DRHODT(k);
+        *w = factor * ( pow(3-q,5) - 6*pow(2-q,5));
+        dwdx[0] = (factor/H) *
+            ((-5)*pow((3-q),4)+30*pow((2-q),4))*(dx[0]/r);
+        dwdx[1] = (factor/H) *
+            ((-5)*pow((3-q),4)+30*pow((2-q),4))*(dx[1]/r);
+    }
+    else if ( q>2.0 && q<=3.0 )
+    {
+        *w = factor * pow(3-q,5);
+        dwdx[0] = (factor/H) * ((-5)*pow((3-q),4))*(dx[0]/r);
+        dwdx[1] = (factor/H) * ((-5)*pow((3-q),4))*(dx[1]/r);
+    }
+    else
+    {
+        *w = 0.0;
+        dwdx[0] = dwdx[1] = 0.0;
     }
 }
 
 
-void
-kernel ( void )
+/* Cubic spline (Monaghan & Lattanzio) */
+static inline void
+kernel_cubic ( real_t factor, real_t q, real_t r, const real_t dx[2],
+    real_t *w, real_t dwdx[2] )
 {
-    static real_t factor = 7.0 / (478.0 * M_PI * H * H);
-    #pragma omp parallel for
-    for ( int_t kk=0; kk<n_pairs; kk++ )
+    if ( q <= 1.0 )
+    {
+        *w = factor * ( 1 - 1.5*q*q + 0.75*q*q*q );
+        dwdx[0] = (factor/(H*H)) * (-3 + 2.25*q) * dx[0];
+        dwdx[1] = (factor/(H*H)) * (-3 + 2.25*q) * dx[1];
+    }
+    else if ( q <= 2.0 )
+    {
+        *w = factor * 0.25 * (2-q)*(2-q)*(2-q);
+        dwdx[0] = (factor/H) * (-0.75*(2-q)*(2-q)) * (dx[0]/r);
+        dwdx[1] = (factor/H) * (-0.75*(2-q)*(2-q)) * (dx[1]/r);
+    }
+    else
+    {
+        *w = 0.0;
+        dwdx[0] = dwdx[1] = 0.0;
+    }
+}
+
+
+/* Wendland C2, dw/dq is a multiple of q so the gradient needs no 1/r */
+static inline void
+kernel_wendland2 ( real_t factor, real_t q, real_t r, const real_t dx[2],
+    real_t *w, real_t dwdx[2] )
+{
+    (void)r;    // No 1/r needed, r is there for the KERNEL_PAIRS signature
+    if ( q <= 2.0 )
+    {
+        real_t u = 1 - 0.5*q, u3 = u*u*u;
+        *w = factor * u3*u * (1 + 2*q);
+        dwdx[0] = (factor/(H*H)) * (-5*u3) * dx[0];
+        dwdx[1] = (factor/(H*H)) * (-5*u3) * dx[1];
+    }
+    else
+    {
+        *w = 0.0;
+        dwdx[0] = dwdx[1] = 0.0;
+    }
+}
+
+
+/* Wendland C4, no 1/r either */
+static inline void
+kernel_wendland4 ( real_t factor, real_t q, real_t r, const real_t dx[2],
+    real_t *w, real_t dwdx[2] )
+{
+    (void)r;
+    if ( q <= 2.0 )
+    {
+        real_t u = 1 - 0.5*q, u5 = u*u*u*u*u;
+        *w = factor * u5*u * (1 + 3*q + (35.0/12.0)*q*q);
+        dwdx[0] = (factor/(H*H)) * (-14.0/3.0) * (1 + 2.5*q) * u5 * dx[0];
+        dwdx[1] = (factor/(H*H)) * (-14.0/3.0) * (1 + 2.5*q) * u5 * dx[1];
+    }
+    else
     {
-        pair_t *p = &pairs[kk];  // convenience alias
-        real_t q = p->q;
+        *w = 0.0;
+        dwdx[0] = dwdx[1] = 0.0;
+    }
+}
+
+
+/* Kernel values of all pairs with the kernel 'value', in a parallel region */
+#ifdef CSR_PAIRS
+#define KERNEL_PAIRS(value)                                             \
+    _Pragma("omp for nowait")                                           \
+    for ( int_t kk=0; kk<n_pairs; kk++ )                                \
+    {                                                                   \
+        int_t i = pairs[kk].i, j = pairs[kk].j;                         \
+        if ( !ACTIVE(i) && !ACTIVE(j) )                                 \
+            continue;                                                   \
+        real_t dx[2] = {X(i)-X(j), Y(i)-Y(j)};                          \
+        real_t r = sqrt ( pow(dx[0],2) + pow(dx[1],2) );                \
+        real_t w, dwdx[2];                                              \
+        value ( factor, r/H, r, dx, &w, dwdx );                         \
+        pair_values[kk].w = w;                                          \
+        pair_values[kk].dwdx[0] = dwdx[0];                              \
+        pair_values[kk].dwdx[1] = dwdx[1];                              \
+    }
+#else
 #ifdef BUCKET
-        real_t dx[2] = {p->ip->x[0] - p->jp->x[0], p->ip->x[1] - p->jp->x[1]};
+#define PAIR_DX(p) {p->ip->x[0] - p->jp->x[0], p->ip->x[1] - p->jp->x[1]}
 #else
-        real_t dx[2] = {X(p->i)-X(p->j), Y(p->i)-Y(p->j)};
+#define PAIR_DX(p) {X(p->i)-X(p->j), Y(p->i)-Y(p->j)}
 #endif //BUCKET
+#define KERNEL_PAIRS(value)                                             \
+    _Pragma("omp for nowait")                                           \
+    for ( int_t kk=0; kk<n_pairs; kk++ )                                \
+    {                                                                   \
+        pair_t *p = &pairs[kk];  /* convenience alias */                \
+        if ( !ACTIVE(p->i) && !ACTIVE(p->j) )                           \
+            continue;                                                   \
+        real_t dx[2] = PAIR_DX(p);                                      \
+        real_t w, dwdx[2];                                              \
+        value ( factor, p->q, p->r, dx, &w, dwdx );                     \
+        p->w = w, p->dwdx[0] = dwdx[0], p->dwdx[1] = dwdx[1];           \
+        if ( ACTIVE(p->i) )                                             \
+            _Pragma("omp atomic")                                       \
+            WSUM(p->i) += p->w;                                         \
+        if ( ACTIVE(p->j) )                                             \
+            _Pragma("omp atomic")                                       \
+            WSUM(p->j) += p->w;                                         \
+    }
+#endif //CSR_PAIRS
 
-        if ( q == 0.0 )
+
+void
+kernel ( void )
+{
+    real_t factor = kernels[problem.kernel].norm / (H * H);
+    #pragma omp parallel
+    {
+        TRACE_BEGIN ( interact );
+        switch ( problem.kernel )
         {
-            p->w = factor * (
-                pow((3-q),5) - 6*pow((2-q),5) + 15*pow((1-q),5)
-            );
-            p->dwdx[0] = p->dwdx[1] = 0.0;
+            case KERNEL_QUINTIC: KERNEL_PAIRS ( kernel_quintic ); break;
+            case KERNEL_CUBIC: KERNEL_PAIRS ( kernel_cubic ); break;
+            case KERNEL_WENDLAND2: KERNEL_PAIRS ( kernel_wendland2 ); break;
+            case KERNEL_WENDLAND4: KERNEL_PAIRS ( kernel_wendland4 ); break;
+            default: break;
         }
-        else if ( q>0.0 && q<=1.0 )
+        TRACE_END ( interact, "kernel pairs" );
+        TRACE_BARRIER ();
+
+#ifdef CSR_PAIRS
+        TRACE_BEGIN ( sum );
+        #pragma omp for nowait
+        for ( int_t i=0; i<(n_field+n_virt+n_mirror); i++ )
         {
-            p->w = factor * (
-                pow((3-q),5) - 6*pow((2-q),5) + 15*pow((1-q),5)
+            if ( !ACTIVE(i) )
+                continue;
+            real_t w_sum = 0.0;
+            for ( int_t e=neighbor_offset[i]; e<neighbor_offset[i+1]; e++ )
+                w_sum += pair_values[neighbors[e].pair].w;
+            WSUM(i) += w_sum;
+        }
+        TRACE_END ( sum, "kernel sums" );
+        TRACE_BARRIER ();
+#endif //CSR_PAIRS
+    }
+}
+
+
+#ifdef CSR_PAIRS
+/* Turn the pairs into neighbor lists: row k holds every particle that
+ * interacts with particle k, and the pair they are in. Pairs are turned
+ * around to i < j, the kernel values are along X(i)-X(j).
+ */
+void
+build_neighbor_lists ( void )
+{
+    int_t n_total = n_field + n_virt + n_mirror;
+    if ( n_total+1 > n_offset_cap )
+    {
+        n_offset_cap = n_total+1;
+        neighbor_offset = realloc ( neighbor_offset, n_offset_cap * sizeof(int_t) );
+        row_end = realloc ( row_end, n_offset_cap * sizeof(int_t) );
+    }
+    if ( 2*n_pairs > n_neighbor_cap )
+    {
+        if ( 2*n_pairs > INT32_MAX )
+        {
+            fprintf ( stderr, "Error: %ld pairs overflow the neighbor "
+                "lists, use more ranks\n", n_pairs
             );
-            p->dwdx[0] = (factor/pow(H,2)) *
-                (-120+120*pow(q,2)-50*pow(q,3))*dx[0];
-            p->dwdx[1] = (factor/pow(H,2)) *
-                (-120+120*pow(q,2)-50*pow(q,3))*dx[1];
+            MPI_Abort ( comm, EOVERFLOW );
         }
-        else if ( q>1.0 && q<=2.0 )
+        n_neighbor_cap = 2*n_pairs + n_pairs/2;
+        neighbor_t *new_neighbors = realloc ( neighbors,
+            n_neighbor_cap * sizeof(neighbor_t)
+        );
+        pair_value_t *new_values = realloc ( pair_values,
+            (n_neighbor_cap/2) * sizeof(pair_value_t)
+        );
+        if ( new_neighbors == NULL || new_values == NULL )
         {
-            p->w = factor * ( pow(3-q,5) - 6*pow(2-q,5));
-            p->dwdx[0] = (factor/H) *
-                ((-5)*pow((3-q),4)+30*pow((2-q),4))*(dx[0]/p->r);
-            p->dwdx[1] = (factor/H) *
-                ((-5)*pow((3-q),4)+30*pow((2-q),4))*(dx[1]/p->r);
+            fprintf ( stderr, "4Not enough memory!\n" );
+            exit ( 1 );
         }
-        else if ( q>2.0 && q<=3.0 )
+        neighbors = new_neighbors;
+        pair_values = new_values;
+    }
+
+    #pragma omp parallel
+    {
+        // Rows are as long as the particles' interaction counts
+        int_t begin, end, length = 0, total;
+        compact_block ( n_total, &begin, &end );
+        for ( int_t k=begin; k<end; k++ )
+            length += INTER(k);
+        int_t offset = compact_offset ( length, &total );
+        for ( int_t k=begin; k<end; k++ )
         {
-            p->w = factor * pow(3-q,5);
-            p->dwdx[0] = (factor/H) * ((-5)*pow((3-q),4))*(dx[0]/p->r);
-            p->dwdx[1] = (factor/H) * ((-5)*pow((3-q),4))*(dx[1]/p->r);
+            neighbor_offset[k] = row_end[k] = offset;
+            offset += INTER(k);
         }
-        else
+        #pragma omp master
+        neighbor_offset[n_total] = total;
+        TRACE_BARRIER ();
+
+        TRACE_BEGIN ( fill );
+        #pragma omp for nowait
+        for ( int_t kk=0; kk<n_pairs; kk++ )
         {
-            p->w = 0.0;
-            p->dwdx[0] = p->dwdx[1] = 0.0;
+            int_t i = MIN ( pairs[kk].i, pairs[kk].j ),
+                j = MAX ( pairs[kk].i, pairs[kk].j ), e;
+            pairs[kk].i = i, pairs[kk].j = j;
+            #pragma omp atomic capture
+            e = row_end[i]++;
+            neighbors[e].j = j, neighbors[e].pair = kk;
+            #pragma omp atomic capture
+            e = row_end[j]++;
+            neighbors[e].j = i, neighbors[e].pair = kk;
         }
-        #pragma omp atomic
-        WSUM(p->i) += p->w;
-        #pragma omp atomic
-        WSUM(p->j) += p->w;
+        TRACE_END ( fill, "neighbor lists fill" );
+        TRACE_BARRIER ();
     }
 }
+#endif //CSR_PAIRS
 
 
 void
@@ -261,7 +661,8 @@ find_neighbors ( void )
             interactions[i] = 0;
 
         #pragma omp barrier
-        #pragma omp for
+        TRACE_BEGIN ( search );
+        #pragma omp for nowait
         for ( int_t i=0; i<n_total-1; i++ )
         {
             for ( int_t j=i+1; j<n_total; j++ )
@@ -280,25 +681,82 @@ find_neighbors ( void )
                     interactions[j] += 1;
                     pairs[kk].i = i;
                     pairs[kk].j = j;
+#ifndef CSR_PAIRS
                     pairs[kk].r = sqrt(dist_sq);
                     pairs[kk].q = pairs[kk].r / H;
                     pairs[kk].w = 0.0;
                     pairs[kk].dwdx[0] = pairs[kk].dwdx[1] = 0.0;
+#endif //CSR_PAIRS
                 }
             }
         }
+        TRACE_END ( search, "find_neighbors pairs" );
+        TRACE_BARRIER ();
 
-        #pragma omp barrier
+        TRACE_BEGIN ( collect );
         for ( int_t i=0; i<n_total; i++ )
         {
             #pragma omp atomic
             INTER(i) += interactions[i];
         }
+        TRACE_END ( collect, "find_neighbors interactions" );
     }
+#ifdef CSR_PAIRS
+    build_neighbor_lists ();
+#endif //CSR_PAIRS
 }
 
 
 #ifdef BUCKET
+/* Hash table slot of the bucket in this direction, -1 if it is empty */
+static inline int_t find_bucket(int64_t key) {
+    int_t slot = BUCKET_HASH(key);
+    while (buckets[slot].key != EMPTY_BUCKET) {
+        if (buckets[slot].key == key)
+            return slot;
+        slot = (slot + 1) & (n_bucket_slots - 1);
+    }
+    return -1;
+}
+
+
+static int compare_buckets(const void* a, const void* b) {
+    int64_t x = buckets[*(const int_t*)a].key, y = buckets[*(const int_t*)b].key;
+    return (x > y) - (x < y);
+}
+
+
+/* One task of the neighbor search: the pairs of all particles in a run
+ * of occupied buckets, found into the buffer of the thread that runs it
+ */
+static void search_block(int_t first, int_t last) {
+    /* Center, North West, North, North East, East, South East, South,
+     * South West, West
+     */
+    static const int around[9][2] = {
+        { 0, 0 }, { -1, 1 }, { 0, 1 }, { 1, 1 }, { 1, 0 },
+        { 1, -1 }, { 0, -1 }, { -1, -1 }, { -1, 0 }
+    };
+    pair_buffer_t* buffer = &pair_buffers[omp_get_thread_num()];
+
+    for (int_t b = first; b < last; ++b) {
+        int64_t key = buckets[occupied_buckets[b]].key;
+        int bx = BUCKET_X(key), by = BUCKET_Y(key);
+
+        /* Neighbor buckets are looked up once for all their particles */
+        int_t heads[9];
+        for (int n = 0; n < 9; ++n) {
+            int_t slot = find_bucket(BUCKET_KEY(bx + around[n][0], by + around[n][1]));
+            heads[n] = (slot < 0) ? -1 : buckets[slot].head;
+        }
+
+        for (int_t i = buckets[occupied_buckets[b]].head; i >= 0; i = next_in_bucket[i])
+            for (int n = 0; n < 9; ++n)
+                create_pairs(&list[i], heads[n], buffer);
+    }
+}
+
+
 void find_neighbors_buckets_ws( void ) {
     int_t n_total = n_field + n_virt + n_mirror;
     n_pairs = 0;
@@ -308,80 +766,103 @@ void find_neighbors_buckets_ws( void ) {
     for ( int_t k=0; k<n_total; k++ )
         INTER(k) = WSUM(k) = AVRHO(k) = 0;
 
-    if ( n_pair_cap < (n_total*n_total) ) // Upper bound, can be smaller
-        resize_pair_list ( n_total*n_total );
+    if ( n_pair_buffers < omp_get_max_threads() ) {
+        pair_buffers = realloc(pair_buffers, omp_get_max_threads() * sizeof(pair_buffer_t));
+        memset(&pair_buffers[n_pair_buffers], 0,
+            (omp_get_max_threads() - n_pair_buffers) * sizeof(pair_buffer_t));
+        n_pair_buffers = omp_get_max_threads();
+    }
 
+    /* Only occupied buckets are stored, in a hash table of at least twice
+     * as many slots as there are particles
+     */
+    if ( n_total > n_bucket_cap ) {
+        n_bucket_cap = n_total;
+        next_in_bucket = realloc(next_in_bucket, n_bucket_cap * sizeof(int_t));
+        occupied_buckets = realloc(occupied_buckets, n_bucket_cap * sizeof(int_t));
+    }
+    if ( n_bucket_slots < 2*n_total ) {
 #ifdef FILL_BUCKETS_LOCK
-    omp_lock_t lock[N_BUCKETS_X*N_BUCKETS_Y];
-
-    for (int i=0; i<N_BUCKETS_X*N_BUCKETS_Y; i++)
-        omp_init_lock(&(lock[i]));
+        for (int_t s = 0; s < n_bucket_slots; ++s)
+            omp_destroy_lock(&(bucket_locks[s]));
+#endif //FILL_BUCKETS_LOCK
+        n_bucket_slots = MAX(n_bucket_slots, 1024);
+        while ( n_bucket_slots < 2*n_total )
+            n_bucket_slots *= 2;
+        buckets = realloc(buckets, n_bucket_slots * sizeof(bucket_t));
+        for (int_t s = 0; s < n_bucket_slots; ++s) {
+            buckets[s].key = EMPTY_BUCKET;
+            buckets[s].head = -1;
+        }
+#ifdef FILL_BUCKETS_LOCK
+        bucket_locks = realloc(bucket_locks, n_bucket_slots * sizeof(omp_lock_t));
+        for (int_t s = 0; s < n_bucket_slots; ++s)
+            omp_init_lock(&(bucket_locks[s]));
 #endif //FILL_BUCKETS_LOCK
+    }
+    n_occupied = 0;
 
     #pragma omp parallel
     {
-        /* Init buckets */
-        #pragma omp for nowait
-        for (int x = 0; x < N_BUCKETS_X; ++x) {
-            for (int y = 0; y < N_BUCKETS_Y; ++y) {
-                buckets[BID(x, y)]->particle = NULL;
-                buckets[BID(x, y)]->next = NULL;
-            }
-        }
+        /* Set up before any barrier, threads waiting in one may run tasks */
+        pair_buffer_t* own = &pair_buffers[omp_get_thread_num()];
+        own->n_pairs = 0;
+        own->interactions = calloc(n_total, sizeof(int_t));
+        int_t* interactions = own->interactions;
 
         /* Compute bucket_x and bucket_y for all particles */
-        #pragma omp for
-        for (int i = 0; i < n_total; ++i) {
+        TRACE_BEGIN ( locate );
+        #pragma omp for nowait
+        for (int_t i = 0; i < n_total; ++i) {
             particle_t *particle = &list[i];
 
-            int actual_x = MIN((int) (((particle->x[0] - subdomain[0])+RADIUS) / BUCKET_RADIUS) , N_BUCKETS_X-1);
-            int actual_y = MIN((int) ((particle->x[1]+1.55*H) / BUCKET_RADIUS),N_BUCKETS_Y-1);
-
             particle->local_idx = i;
-            particle->bucket_x = actual_x;
-            particle->bucket_y = actual_y;
+            particle->bucket_x = floor(((particle->x[0] - subdomain[0])+halo_reach) / BUCKET_RADIUS);
+            particle->bucket_y = floor((particle->x[1]+1.55*H) / BUCKET_RADIUS);
         }
+        TRACE_END ( locate, "buckets locate" );
+        TRACE_BARRIER ();
 
        /* Fill buckets */
+        TRACE_BEGIN ( fill );
 #ifdef FILL_BUCKETS_LOCK
-        fill_buckets2(buckets, n_total, lock);
+        fill_buckets2(n_total);
 #else
-        fill_buckets1(buckets, n_total);
+        fill_buckets1(n_total);
 #endif //FILL_BUCKETS_LOCK
-
-        int_t* interactions = calloc(n_total, sizeof(int_t));
-
-        /* Create neighbors */
-        #pragma omp for
-        for (int_t i = 0; i < n_total-1; ++i) {
-            particle_t* particle = &list[i];
-            int bx = particle->bucket_x;
-            int by = particle->bucket_y;
-
-            /* Center */
-            create_pairs(bx, by, buckets, particle, &n_pairs, interactions);
-            /* North West */
-            create_pairs(bx-1, by+1, buckets, particle, &n_pairs, interactions);
-            /* North */
-            create_pairs(bx, by+1, buckets, particle, &n_pairs, interactions);
-            /* North East */
-            create_pairs(bx+1, by+1, buckets, particle, &n_pairs, interactions);
-            /* East */
-            create_pairs(bx+1, by, buckets, particle, &n_pairs, interactions);
-            /* South East */
-            create_pairs(bx+1, by-1, buckets, particle, &n_pairs, interactions);
-            /* South */
-            create_pairs(bx, by-1, buckets, particle, &n_pairs, interactions);
-            /* South West */
-            create_pairs(bx-1, by-1, buckets, particle, &n_pairs, interactions);
-            /* West */
-            create_pairs(bx-1, by, buckets, particle, &n_pairs, interactions);
+        TRACE_END ( fill, "buckets fill" );
+        TRACE_BARRIER ();
+
+        /* Create neighbors: runs of SEARCH_BLOCK^2 occupied buckets in
+         * key order are handed out as tasks that idle threads take over
+         */
+        TRACE_BEGIN ( search );
+        #pragma omp single nowait
+        {
+            qsort(occupied_buckets, n_occupied, sizeof(int_t), compare_buckets);
+            int_t run = SEARCH_BLOCK * SEARCH_BLOCK;
+            #pragma omp taskloop grainsize(1)
+            for (int_t b = 0; b < n_occupied; b += run)
+                search_block(b, MIN(b + run, n_occupied));
         }
-
-
+        TRACE_END ( search, "buckets pairs" );
+        TRACE_BARRIER ();
+
+        /* Concatenate the thread buffers at their prefix sums */
+        TRACE_BEGIN ( concat );
+        int_t total;
+        own->offset = compact_offset(own->n_pairs, &total);
+        #pragma omp single
+        {
+            n_pairs = total;
+            if (n_pair_cap < n_pairs)
+                resize_pair_list(n_pairs + n_pairs/4);
+        }
+        memcpy(&pairs[own->offset], own->pairs, own->n_pairs * sizeof(pair_t));
+        TRACE_END ( concat, "buckets concatenate" );
 
         /* Collect interactions */
-
+        TRACE_BEGIN ( collect );
         if (n_total > 0) {
             int t = omp_get_thread_num();
             int numThreads = omp_get_num_threads();
@@ -409,157 +890,274 @@ void find_neighbors_buckets_ws( void ) {
 
 
         free(interactions);
+        TRACE_END ( collect, "buckets interactions" );
 
-        /* Free buckets */
-        #pragma omp for
-        for (int x = 0; x < N_BUCKETS_X; ++x) {
-            for (int y = 0; y < N_BUCKETS_Y; ++y) {
-                buckets[BID(x, y)]->particle = NULL;
-                if (buckets[BID(x, y)]->next != NULL) {
-                    free_buckets(buckets[BID(x, y)]->next);
-                }
-            }
+        /* Empty the occupied buckets, the rest of the table still is */
+        TRACE_BEGIN ( release );
+        #pragma omp for nowait
+        for (int_t b = 0; b < n_occupied; ++b) {
+            buckets[occupied_buckets[b]].key = EMPTY_BUCKET;
+            buckets[occupied_buckets[b]].head = -1;
         }
+        TRACE_END ( release, "buckets free" );
+        TRACE_BARRIER ();
     }
-
-#ifdef FILL_BUCKETS_LOCK
-    for (int i=0; i<N_BUCKETS_X*N_BUCKETS_Y; i++)
-        omp_destroy_lock(&(lock[i]));
-#endif //FILL_BUCKETS_LOCK
-
-
+    n_occupied = 0;
+#ifdef CSR_PAIRS
+    build_neighbor_lists ();
+#endif //CSR_PAIRS
 }
 #endif //BUCKET
 
 #ifdef BUCKET
-static inline void fill_buckets1(bucket_t** buckets, int n_total) {
-    #pragma omp for
-    for (int x = 0; x < N_BUCKETS_X; ++x) {
-        for (int y = 0; y < N_BUCKETS_Y; ++y) {
-            bucket_t* bucket = buckets[BID(x, y)];
-
-            for (int i = 0; i < n_total; ++i) {
-                particle_t* particle = &list[i];
-
-                if (particle->bucket_x != x || particle->bucket_y != y)  {
-                    continue;
-                }
-
-                if(bucket->particle == NULL) {
-                    bucket->particle = particle;
-                } else {
-                    bucket_t* new_bucket = (bucket_t*)malloc(sizeof(bucket_t));
-                    new_bucket->particle = particle;
-                    new_bucket->next = bucket;
+/* Record a bucket taken into use, for the search and the cleanup */
+static inline void occupy_bucket(int_t slot, int64_t key) {
+    int_t b;
+    #pragma omp atomic capture
+    b = n_occupied++;
+    occupied_buckets[b] = slot;
+    #pragma omp atomic write
+    buckets[slot].key = key;
+}
+#endif //BUCKET
 
-                    buckets[BID(x, y)] = new_bucket;
+#ifdef BUCKET
+static inline void fill_buckets1(int_t n_total) {
+    #pragma omp for nowait
+    for (int_t i = 0; i < n_total; ++i) {
+        particle_t* particle = &list[i];
+        int64_t key = BUCKET_KEY(particle->bucket_x, particle->bucket_y);
+        int_t slot = BUCKET_HASH(key);
+
+        /* Probe for the bucket, empty slots are claimed one at a time */
+        while (1) {
+            int64_t found;
+            #pragma omp atomic read
+            found = buckets[slot].key;
+            if (found == EMPTY_BUCKET) {
+                #pragma omp critical (claim_bucket)
+                {
+                    #pragma omp atomic read
+                    found = buckets[slot].key;
+                    if (found == EMPTY_BUCKET) {
+                        occupy_bucket(slot, key);
+                        found = key;
+                    }
                 }
             }
+            if (found == key)
+                break;
+            slot = (slot + 1) & (n_bucket_slots - 1);
         }
+
+        /* Push the particle on the bucket's chain */
+        #pragma omp atomic capture
+        { next_in_bucket[i] = buckets[slot].head; buckets[slot].head = i; }
     }
 }
 #endif //BUCKET
 
 #ifdef BUCKET
 #ifdef FILL_BUCKETS_LOCK
-static inline void fill_buckets2(bucket_t** buckets, int n_total, omp_lock_t lock[N_BUCKETS_X*N_BUCKETS_Y]) {
-    #pragma omp for
-    for (int i = 0; i < n_total; ++i) {
-        /* Give particle a local index */
-        list[i].local_idx = i;
-
-        /* Compute bucket coordinates */
-        int bucket_x = list[i].bucket_x;
-        int bucket_y = list[i].bucket_y;
-
-        /*Lock possible critical section*/
-        omp_set_lock(&(lock[BID(bucket_x,bucket_y)]));
-
-        /* Pointer to relevant bucket */
-        bucket_t* bucket = buckets[BID(bucket_x, bucket_y)];
-
-        if (bucket->particle == NULL) {
-            bucket->particle = &list[i];
-            bucket->next = NULL;
-        } else {
-            bucket_t* new_bucket = (bucket_t*)malloc(sizeof(bucket_t));
-            new_bucket->particle = &list[i];
-            new_bucket->next = bucket;
-
-            buckets[BID(bucket_x, bucket_y)] = new_bucket;
+static inline void fill_buckets2(int_t n_total) {
+    #pragma omp for nowait
+    for (int_t i = 0; i < n_total; ++i) {
+        particle_t* particle = &list[i];
+        int64_t key = BUCKET_KEY(particle->bucket_x, particle->bucket_y);
+        int_t slot = BUCKET_HASH(key);
+
+        while (1) {
+            /*Lock possible critical section*/
+            omp_set_lock(&(bucket_locks[slot]));
+
+            if (buckets[slot].key == EMPTY_BUCKET)
+                occupy_bucket(slot, key);
+            if (buckets[slot].key == key) {
+                next_in_bucket[i] = buckets[slot].head;
+                buckets[slot].head = i;
+                omp_unset_lock(&(bucket_locks[slot]));
+                break;
+            }
+            /*Unlock*/
+            omp_unset_lock(&(bucket_locks[slot]));
+            slot = (slot + 1) & (n_bucket_slots - 1);
         }
-        /*Unlock*/
-        omp_unset_lock(&(lock[BID(bucket_x,bucket_y)]));
     }
 }
 #endif //FILL_BUCKETS_LOCK
 #endif //BUCKET
 
 #ifdef BUCKET
-void free_buckets(bucket_t* bucket) {
-    if (bucket->next != NULL) {
-        free_buckets(bucket->next);
+void create_pairs(particle_t* particle, int_t head, pair_buffer_t* buffer) {
+    for (int_t j = head; j >= 0; j = next_in_bucket[j]) {
+        particle_t* other = &list[j];
+        if (other->local_idx < particle->local_idx) {
+            double distance = sqrt(
+                                   pow(particle->x[0] - other->x[0], 2) +
+                                   pow(particle->x[1] - other->x[1], 2)
+                                   );
+            if (distance <= RADIUS) {
+                buffer->interactions[particle->local_idx]++;
+                buffer->interactions[other->local_idx]++;
+
+                if (buffer->n_pairs == buffer->capacity) {
+                    buffer->capacity = MAX(CAP_INCREMENT, 2*buffer->capacity);
+                    pair_t* new_pairs = realloc(buffer->pairs, buffer->capacity * sizeof(pair_t));
+                    if (new_pairs == NULL) {
+                        fprintf(stderr, "3Not enough memory!\n");
+                        exit(1);
+                    }
+                    buffer->pairs = new_pairs;
+                }
+                pair_t* pair = &(buffer->pairs[buffer->n_pairs++]);
+
+                pair->i = particle->local_idx;
+                pair->j = other->local_idx;
+#ifndef CSR_PAIRS
+                pair->ip = particle;
+                pair->jp = other;
+                pair->r = distance;
+                pair->q = distance / H;
+                pair->w = 0.0;
+                pair->dwdx[0] = pair->dwdx[1] = 0.0;
+#endif //CSR_PAIRS
+
+            }
+        }
     }
-    free(bucket);
 }
 #endif //BUCKET
 
-#ifdef BUCKET
-void create_pairs(int bx, int by, bucket_t** buckets,
-                  particle_t* particle, int_t* n_pairs,
-                  int_t* interactions) {
-    if (bx >= N_BUCKETS_X || bx < 0 || by >= N_BUCKETS_Y || by < 0 || particle == NULL) {
-        return;
+#ifdef BLOCK_STEP
+/* Block time steps: particle k is kicked every 2^LEVEL(k) steps, and
+ * drifts with its last velocity and density rate in between. Ghosts and
+ * mirrors are always active, they are rebuilt from current state anyway.
+ */
+void
+mark_active ( int_t timestep )
+{
+    int_t
+        n_real = n_field + n_halo,
+        n_total = n_field + n_virt + n_mirror,
+        n_active = 0;
+    if ( n_total > n_active_cap )
+    {
+        n_active_cap = n_total;
+        active = realloc ( active, n_active_cap * sizeof(bool) );
+        wake = realloc ( wake, n_active_cap * sizeof(int) );
     }
+    #pragma omp parallel for reduction(+:n_active)
+    for ( int_t k=0; k<n_total; k++ )
+    {
+        active[k] = ( k >= n_real ) || ( timestep % (1 << LEVEL(k)) ) == 0;
+        if ( k < n_real && active[k] )
+            n_active += 1;
+    }
+    n_active_updates += n_active;
+    n_real_updates += n_real;
+}
 
-    bucket_t* current = buckets[BID(bx, by)];
-    while (current != NULL && current->particle != NULL) {
-        if (current->particle->idx < particle->idx) {
-            double distance = sqrt(
-                                   pow(particle->x[0] - current->particle->x[0], 2) +
-                                   pow(particle->x[1] - current->particle->x[1], 2)
-                                   );
-            if (distance <= RADIUS) {
-                interactions[particle->local_idx]++;
-                interactions[current->particle->local_idx]++;
-
-                int pair_idx;
-                #pragma omp atomic capture
-                pair_idx = (*n_pairs)++;
-
-                pairs[pair_idx].i = particle->local_idx;
-                pairs[pair_idx].j = current->particle->local_idx;
-                pairs[pair_idx].ip = particle;
-                pairs[pair_idx].jp = current->particle;
-                pairs[pair_idx].r = distance;
-                pairs[pair_idx].q = distance / H;
-                pairs[pair_idx].w = 0.0;
-                pairs[pair_idx].dwdx[0] = pairs[pair_idx].dwdx[1] = 0.0;
 
-            }
+/* New level of an active particle from its own CFL and force limits,
+ * dt itself (fixed or adapted) is the finest level. It may only rise one
+ * level at a time, to a level whose next kick lands on the block grid.
+ */
+static inline int_t
+choose_level ( int_t k, int_t timestep )
+{
+    real_t
+        v = sqrt ( VX(k)*VX(k) + VY(k)*VY(k) ),
+        a = sqrt ( DVX(k,0)*DVX(k,0) + DVX(k,1)*DVX(k,1) ),
+        dt_k = BLOCK_COURANT * H / ( sos + v );
+    if ( a > 0.0 )
+        dt_k = MIN ( dt_k, 0.25 * sqrt ( H / a ) );
+
+    int_t level = 0;
+    while ( level < MAX_LEVEL && level <= LEVEL(k)
+        && dt * (2 << level) <= dt_k
+        && ( timestep % (2 << level) ) == 0
+    )
+        level += 1;
+    return level;
+}
+
+
+/* Wake-up limiter, after the kicks: a particle more than one level above
+ * a neighbor kicked in this step would drift on a stale rate while the
+ * splash reaches it. It drops to the neighbor's level + 1, or lower to
+ * land on the block grid, so that it is kicked next step. The half kick
+ * it got at its last kick is corrected to the steps it has drifted since.
+ */
+static void
+wake_neighbors ( int_t timestep )
+{
+    int_t
+        n_real = n_field + n_halo,
+        n_total = n_field + n_virt + n_mirror;
+    #pragma omp parallel
+    {
+        #pragma omp for
+        for ( int_t k=0; k<n_total; k++ )
+            wake[k] = 0;
+        #pragma omp for
+        for ( int_t kk=0; kk<n_pairs; kk++ )
+        {
+            int_t i = pairs[kk].i, j = pairs[kk].j;
+            if ( j < n_real && LEVEL(j) > LEVEL(i) + 1
+                && ( timestep % (1 << LEVEL(i)) ) == 0 )
+                #pragma omp atomic
+                wake[j] |= 1 << (LEVEL(i) + 1);
+            if ( i < n_real && LEVEL(i) > LEVEL(j) + 1
+                && ( timestep % (1 << LEVEL(j)) ) == 0 )
+                #pragma omp atomic
+                wake[i] |= 1 << (LEVEL(j) + 1);
+        }
+        #pragma omp for
+        for ( int_t k=0; k<n_real; k++ )
+        {
+            if ( wake[k] == 0 )
+                continue;
+            int_t level = 0;
+            while ( ( wake[k] & (1 << level) ) == 0 )
+                level += 1;
+            while ( ( (timestep+1) % (1 << level) ) != 0 )
+                level -= 1;
+            int_t since = 1 + timestep % (1 << LEVEL(k)),
+                half = 1 << LEVEL(k), next = 1 << level;
+            real_t correction = dt * ( since - 0.5 * (half + next) );
+            VX(k) += correction * DVX(k,0);
+            VY(k) += correction * DVX(k,1);
+            LEVEL(k) = level;
         }
-        current = current->next;
     }
 }
-#endif //BUCKET
+#endif //BLOCK_STEP
+
 
 void
 time_step ( int_t timestep )
 {
+#ifdef BLOCK_STEP
+    mark_active ( timestep );
+#endif //BLOCK_STEP
     if ( timestep > 0 )
     {
         #pragma omp parallel for
-        for ( int_t k=0; k<n_field; k++ )
+        for ( int_t k=0; k<(n_field+n_halo); k++ )
         {
             // Vx, Vy cloned to vx_min vy_min for some reason
             // Omitting this until I see the purpose
-            VX(k) += 0.5 * dt * DVX(k,0);
-            VY(k) += 0.5 * dt * DVX(k,1);
+            if ( ACTIVE(k) )
+            {
+                VX(k) += 0.5 * STEP(k) * DVX(k,0);
+                VY(k) += 0.5 * STEP(k) * DVX(k,1);
+            }
             X(k) += dt * VX(k);
             Y(k) += dt * VY(k);
         }
     }
-    MPI_Barrier(MPI_COMM_WORLD);
+    TIMING_BARRIER();
+    PERF_BEGIN ( PERF_FIND_NEIGHBORS );
 #ifdef BUCKET
     double fn_start = MPI_Wtime();
     find_neighbors_buckets_ws();
@@ -569,8 +1167,11 @@ time_step ( int_t timestep )
     find_neighbors();
     double fn_end = MPI_Wtime();
 #endif //BUCKET
+    PERF_END ( PERF_FIND_NEIGHBORS );
     t_find_neighbors += fn_end - fn_start;
     kernel();
+    if ( timestep == snapshot_step )
+        dump_snapshot ( timestep );
     cont_density();
     if ( timestep > 0 )
         correction();
@@ -578,21 +1179,26 @@ time_step ( int_t timestep )
     ext_force();
 
     #pragma omp parallel for
-    for ( int_t k=0; k<n_field; k++ )
+    for ( int_t k=0; k<(n_field+n_halo); k++ )
     {
+        if ( !ACTIVE(k) )
+            continue;
         DVX(k,0) = INDVXDT(k,0) + EXDVXDT(k,0); //+ ardvxdt
         DVX(k,1) = INDVXDT(k,1) + EXDVXDT(k,1); //+ ardvxdt
+#ifdef BLOCK_STEP
+        LEVEL(k) = choose_level ( k, timestep );
+#endif //BLOCK_STEP
     }
 
     if ( timestep == 0 )
     {
         #pragma omp parallel for
-        for ( int_t k=0; k<n_field; k++ )
+        for ( int_t k=0; k<(n_field+n_halo); k++ )
         {
             // Calculate initial distributions
             RHO(k) += 0.5 * dt * DRHODT(k);
-            VX(k) += 0.5 * dt * DVX(k,0);
-            VY(k) += 0.5 * dt * DVX(k,1);
+            VX(k) += 0.5 * STEP(k) * DVX(k,0);
+            VY(k) += 0.5 * STEP(k) * DVX(k,1);
             X(k) += dt * VX(k);
             Y(k) += dt * VY(k);
         }
@@ -600,12 +1206,15 @@ time_step ( int_t timestep )
     else
     {
         #pragma omp parallel for
-        for ( int_t k=0; k<(n_field); k++ )
+        for ( int_t k=0; k<(n_field+n_halo); k++ )
         {
             RHO(k) += 0.5 * dt * DRHODT(k);
 
-            VX(k) += 0.5 * dt * DVX(k,0);
-            VY(k) += 0.5 * dt * DVX(k,1);
+            if ( ACTIVE(k) )
+            {
+                VX(k) += 0.5 * STEP(k) * DVX(k,0);
+                VY(k) += 0.5 * STEP(k) * DVX(k,1);
+            }
 
             // Reflect velocity at boundaries
             if (Y(k) < 0.0 && VY(k) < 0.0)
@@ -620,70 +1229,235 @@ time_step ( int_t timestep )
 
         }
     }
+#ifdef BLOCK_STEP
+    wake_neighbors ( timestep );
+#endif //BLOCK_STEP
+}
+
+
+/* Global maximum speed and acceleration of the field particles */
+void
+max_motion ( real_t *v_max, real_t *a_max )
+{
+    real_t v_sq = 0.0, a_sq = 0.0, local[2], global[2];
+    #pragma omp parallel for reduction(max:v_sq,a_sq)
+    for ( int_t k=0; k<n_field; k++ )
+    {
+        v_sq = MAX ( v_sq, VX(k)*VX(k) + VY(k)*VY(k) );
+        a_sq = MAX ( a_sq, DVX(k,0)*DVX(k,0) + DVX(k,1)*DVX(k,1) );
+    }
+    local[0] = v_sq, local[1] = a_sq;
+    MPI_Allreduce ( local, global, 2, REAL_MACRO_MPI, MPI_MAX,
+        comm
+    );
+    *v_max = sqrt ( global[0] );
+    *a_max = sqrt ( global[1] );
+}
+
+
+/* Largest stable step: the acoustic CFL condition with the flow speed on
+ * top of the speed of sound, and the force condition. There is no
+ * artificial viscosity, so no viscous condition applies.
+ * time_step() kicks half a step on each side of the force evaluation, so
+ * changing dt between steps gives the variable-step leapfrog weights.
+ */
+void
+adapt_time_step ( real_t v_max, real_t a_max )
+{
+    dt = courant * H / ( sos + v_max );
+    if ( a_max > 0.0 )
+        dt = MIN ( dt, 0.25 * sqrt ( H / a_max ) );
+}
+
+
+/* Choose how many steps the next deep halo lasts, and its width.
+ * Particles move at most drift = 2*k*dt*v in k steps (time_step drifts
+ * twice), while errors from the cut-off halo edge travel inward by one
+ * interaction radius per step. The halo must cover both, and still fit
+ * within the neighbor's slab including its own drifted particles.
+ */
+void
+choose_halo_depth ( real_t v_max, real_t a_max )
+{
+    real_t slab = B / (real_t)size;
+    halo_depth = 1;
+    halo_width = RADIUS;
+    halo_drift = 0.0;
+    for ( int_t k=2; k<=halo_depth_max; k++ )
+    {
+        real_t
+            drift = 2 * k * dt * ( v_max + 2 * k * dt * a_max ),
+            width = k * RADIUS + 2 * drift;
+        if ( width + drift > slab )
+            break;
+        halo_depth = k;
+        halo_width = width;
+        halo_drift = drift;
+    }
 }
 
 
 void
 time_integration ( void )
 {
+    int_t halo_steps = 0;   // Steps until the list must be rebuilt
+    real_t output_interval = checkpoint_frequency * problem.dt;
+    int_t next_output = ( checkpoint_frequency > 0 )
+        ? (int_t)( t_sim / output_interval + 0.5 )
+            + ( restart ? 1 : 0 )   // Restart file is already written
+        : 0;
     /* Construct local list */
     for ( int_t timestep=min_iteration; timestep<max_iteration ; timestep++ )
     {
-        // Reinitialize list of actuals
-        n_field = n_particles();
-        resize_list ( n_field );
+        bool new_list = ( halo_steps == 0 );
+        if ( new_list )
+        {
+            // Reinitialize list of actuals
+            n_field = n_particles();
+            resize_list ( n_field );
+
+            // Prepare list of local particles
+            marshal_particles ( &(list[0]) );
+
+            // Speed bounds for the time step and deep halo width,
+            // dt stays fixed for the lifetime of a deep halo
+            if ( courant > 0.0 || halo_depth_max > 1 )
+            {
+                real_t v_max, a_max;
+                max_motion ( &v_max, &a_max );
+                if ( courant > 0.0 )
+                    adapt_time_step ( v_max, a_max );
+                if ( halo_depth_max > 1 && timestep > 0 )
+                    choose_halo_depth ( v_max, a_max );
+            }
 
-        // Prepare list of local particles
-        marshal_particles ( &(list[0]) );
+            // Deep halos are exchanged before ghosts are added, the
+            // mirrors are integrated and get ghosts of their own
+            if ( halo_depth_max > 1 )
+            {
+                n_virt = 0;
+                TIMING_BARRIER();
+                t_start = MPI_Wtime();
+                PERF_BEGIN ( PERF_BORDER );
+                border_exchange();
+                PERF_END ( PERF_BORDER );
+                t_end = MPI_Wtime();
+                t_border += t_end - t_start;
+                n_halo = n_mirror;
+            }
+            halo_steps = halo_depth;
+        }
 
         // Add ghosts, append to list
         // This calculates n_virt, so n_field+n_virt=n_total for now
-        MPI_Barrier(MPI_COMM_WORLD);
+        TIMING_BARRIER();
         t_start = MPI_Wtime();
+        PERF_BEGIN ( PERF_GENERATE );
+        if ( new_list && halo_depth_max > 1 )
+            find_near_wall ( halo_drift );
         generate_virtual_particles();
+        PERF_END ( PERF_GENERATE );
         t_end = MPI_Wtime();
         t_generate += t_end - t_start;
 
         // Synchronize with neighbors: mirror particles & mirror ghosts
         // Outcome is flat list, mirror particle count in n_mirror
-        MPI_Barrier(MPI_COMM_WORLD);
-        t_start = MPI_Wtime();
-        border_exchange();
-        t_end = MPI_Wtime();
-        t_border += t_end - t_start;
+        if ( halo_depth_max == 1 )
+        {
+            TIMING_BARRIER();
+            t_start = MPI_Wtime();
+            PERF_BEGIN ( PERF_BORDER );
+            border_exchange();
+            PERF_END ( PERF_BORDER );
+            t_end = MPI_Wtime();
+            t_border += t_end - t_start;
+        }
 
         // Node-local physics
-        MPI_Barrier(MPI_COMM_WORLD);
+        TIMING_BARRIER();
         t_start = MPI_Wtime();
+        PERF_BEGIN ( PERF_TIMESTEP );
         time_step ( timestep );
+        PERF_END ( PERF_TIMESTEP );
         t_end = MPI_Wtime();
         t_timestep += t_end - t_start;
 
         // Retrieve updates to actual particles from local list into hash tab
         unmarshal_particles( list, n_field );
 
-        // Migrate particles moved across subdomain boundaries
-        MPI_Barrier(MPI_COMM_WORLD);
-        t_start = MPI_Wtime();
-        migrate_particles();
-        t_end = MPI_Wtime();
-        t_migrate += t_end - t_start;
+        // Migrate particles moved across subdomain boundaries,
+        // batched until the halo expires
+        halo_steps -= 1;
+        if ( halo_steps == 0 )
+        {
+            TIMING_BARRIER();
+            t_start = MPI_Wtime();
+            PERF_BEGIN ( PERF_MIGRATE );
+            migrate_particles();
+            PERF_END ( PERF_MIGRATE );
+            t_end = MPI_Wtime();
+            t_migrate += t_end - t_start;
+        }
 
-        // Write field state to file every few iterations
+        // Write field state to file every few iterations, or at every
+        // multiple of the same simulated time when dt adapts
+        bool output = false;
+        int_t output_index = 0;
+        if ( checkpoint_frequency <= 0 )
+            ;   // Snapshots are off (-c 0)
+        else if ( courant > 0.0 )
+        {
+            output_index = (int_t)( t_sim / output_interval );
+            output = ( output_index >= next_output );
+            if ( output )
+                next_output = output_index + 1;
+        }
+        else
+        {
+            output_index = timestep / checkpoint_frequency;
+            output = ( (timestep % checkpoint_frequency) == 0 );
+        }
+        t_sim += dt;
 #ifndef NO_IO
-        if ((timestep % checkpoint_frequency) == 0) {
-            MPI_Barrier(MPI_COMM_WORLD);
+        if ( diag_frequency > 0 && (timestep % diag_frequency) == 0 )
+        {
+            t_start = MPI_Wtime();
+            diag_sample ( timestep );
+            t_io += MPI_Wtime() - t_start;
+        }
+        if ( view_frequency > 0 && (timestep % view_frequency) == 0 )
+        {
+            TIMING_BARRIER();
             t_start = MPI_Wtime();
             char filename[256];
-            memset ( filename, 0, 256*sizeof(char) );
-            sprintf ( filename, "plot/%.4ld.dat",
-                timestep/checkpoint_frequency
+            sprintf ( filename, "%s/view_%.4ld.dat", output_dir,
+                timestep / view_frequency
             );
+            PERF_BEGIN ( PERF_IO );
+            dump_state ( filename );
+            PERF_END ( PERF_IO );
+            t_io += MPI_Wtime() - t_start;
+        }
+        if ( output ) {
+            TIMING_BARRIER();
+            t_start = MPI_Wtime();
+            char filename[256];
+            memset ( filename, 0, 256*sizeof(char) );
+            sprintf ( filename, "%s/%.4ld.dat", output_dir, output_index );
             if ( rank == 0 )
                 printf ( "Output at step %ld, '%s'\n", timestep, filename );
 
+            PERF_BEGIN ( PERF_IO );
             collect_checkpoint();
             write_checkpoint ( filename );
+            if ( frame.width > 0 )
+            {
+                sprintf ( filename, "%s/%.4ld.%s", output_dir, output_index,
+                    frame.ppm ? "ppm" : "png"
+                );
+                write_frame ( filename );
+            }
+            PERF_END ( PERF_IO );
             t_end = MPI_Wtime();
             t_io += t_end - t_start;
         } else if (verbose && rank == 0)
@@ -699,17 +1473,29 @@ time_integration ( void )
     print_timing("Particle migration: %.4lf, ", "%.4lf, ", t_migrate);
     print_timing("Input/output: %.4lf, ", "%.4lf, ", t_io);
     print_timing("Find neighbors: %.4lf, ", "%.4lf, ", t_find_neighbors);
+#ifdef WITH_PERF
+    perf_report();
+#endif //WITH_PERF
+
+#ifdef BLOCK_STEP
+    print_timing ( "Active particle fraction: %.4lf, ", "%.4lf, ",
+        (double)n_active_updates / (double)MAX(1,n_real_updates)
+    );
+#endif //BLOCK_STEP
 
     /* Print shared variables */
+    if ( rank == 0 && courant > 0.0 )
+        printf ( "Simulated %lf s in %ld steps, final dt %e\n",
+            t_sim, max_iteration - min_iteration, dt
+        );
     if (rank == 0) {
         printf ( "%lld particles\n", n_global_field );
-        printf ( "%d ranks, OMP_NUM_THREADS=", size );
-        int sys_retval = system ( "echo ${OMP_NUM_THREADS}" );
-        printf ( "\t(returned %d)\n", sys_retval );
+        printf ( "%d ranks, %d threads each\n", size, omp_get_max_threads() );
     }
 }
 
 
+#ifndef NO_MAIN
 int
 main ( int argc, char **argv )
 {
@@ -720,6 +1506,23 @@ main ( int argc, char **argv )
     east = (rank + 1) % size;
     west = (rank + size - 1) % size;
 
+    /* Halo width and the furthest a deep halo may reach */
+    halo_width = halo_reach = RADIUS;
+    if ( halo_depth_max > 1 )
+        halo_reach = MAX ( RADIUS, B / (real_t)size );
+#ifdef WITH_SHM
+    shm_init();
+#endif //WITH_SHM
+#ifdef WITH_PERF
+    perf_init();
+#endif //WITH_PERF
+#ifdef WITH_TRACE
+    trace_init();
+#endif //WITH_TRACE
+    numa_report();
+    diag_init();
+    aggregate_init();
+
     if ( !restart )
         initialize();
     else
@@ -730,88 +1533,174 @@ main ( int argc, char **argv )
 
     MPI_Finalize();
 }
+#endif //NO_MAIN
+
+
+/* Particle k is within 'reach' of a wall */
+static inline bool
+near_wall_at ( int_t k, real_t reach )
+{
+    return X(k) < reach || X(k) > B-reach || Y(k) < reach;
+}
+
+
+/* Room for the near-wall set of n_real particles */
+static void
+near_wall_capacity ( int_t n_real )
+{
+    if ( n_near_wall_cap < n_real )
+    {
+        n_near_wall_cap = n_real;
+        near_wall = realloc ( near_wall, n_near_wall_cap * sizeof(int_t) );
+    }
+}
+
+
+/* Collect the field and deep halo particles that are close enough to a
+ * wall to get ghosts while the list lasts, 'margin' covers how far they
+ * move meanwhile
+ */
+void
+find_near_wall ( real_t margin )
+{
+    int_t n_real = n_field + n_halo;
+    real_t reach = 1.55*H + margin;
+    near_wall_capacity ( n_real );
+
+    #pragma omp parallel
+    {
+        int_t begin, end, count = 0, total;
+        compact_block ( n_real, &begin, &end );
+        for ( int_t k=begin; k<end; k++ )
+            count += near_wall_at ( k, reach );
+        int_t at = compact_offset ( count, &total );
+        for ( int_t k=begin; k<end; k++ )
+            if ( near_wall_at ( k, reach ) )
+                near_wall[at++] = k;
+        #pragma omp master
+        n_near_wall = total;
+    }
+}
+
+
+/* Number of ghosts particle k gets: left, right, bottom and corners */
+static inline int_t
+ghost_count ( int_t k, real_t boundary )
+{
+    bool
+        left = X(k) < boundary,
+        right = X(k) > B-boundary,
+        bottom = Y(k) < boundary;
+    return left + right + bottom + (left && bottom) + (right && bottom);
+}
 
 
 void
 generate_virtual_particles ( void )
 {
-    n_virt = 0;
     real_t boundary = 1.55*H;
 
-    // No particle adds more than 5 ghosts, make sure we have space
-    resize_list(n_field * 5);
-
-    // Loop over all actual particles, detect boundary interactions
-    #pragma omp parallel for shared(n_virt)
-    for ( int_t k=0; k<n_field; k++ )
+    // Deep halo particles are integrated here, they need ghosts too
+    int_t n_real = n_field + n_halo;
+
+    // Only the particles near a wall can interact with it, their ghosts
+    // are appended in list order. Deep halos keep the near-wall set while
+    // the list lasts. Lists of one step test every particle here, each
+    // thread notes its near-wall particles in its own block of the set.
+    // The ghosts are counted first, so that the list grows outside of the
+    // parallel regions, where its pages are first touched in parallel.
+    bool scan = ( halo_depth_max == 1 );
+    if ( scan )
+        near_wall_capacity ( n_real );
+    int_t blocks[omp_get_max_threads()][3];   // begin, end, first ghost
+    #pragma omp parallel
     {
-        int_t current_n_virt;
-
-        // Horizontal mirror left
-        if ( X(k) < boundary )
+        int_t begin, end, count = 0, total,
+            *block = blocks[omp_get_thread_num()];
+        if ( scan )
         {
-            // Make use of one more list slot as ghost-k
-            #pragma omp atomic capture
-            current_n_virt = n_virt++;
-
-            int_t gk = n_field + current_n_virt;
-            X(gk) = -X(k), VX(gk) = -VX(k);
-            Y(gk) = Y(k),  VY(gk) = VY(k);
-            P(gk) = P(k), RHO(gk) = RHO(k), M(gk) = M(k);
-            TYPE(gk) = -2, HSML(gk) = H;
+            compact_block ( n_real, &begin, &end );
+            int_t last = begin;
+            real_t right = B - boundary;
+            for ( int_t k=begin; k<end; k++ )
+                if ( X(k) < boundary || X(k) > right || Y(k) < boundary )
+                    near_wall[last++] = k;
+            end = last;
+            for ( int_t c=begin; c<end; c++ )
+                count += ghost_count ( near_wall[c], boundary );
         }
-
-        // Horizontal mirror right
-        if ( X(k) > B-boundary )
+        else
         {
-            #pragma omp atomic capture
-            current_n_virt = n_virt++;
-
-            int_t gk = n_field + current_n_virt;
-            X(gk) = 2*B-X(k), VX(gk) = -VX(k);
-            Y(gk) = Y(k),     VY(gk) = VY(k);
-            P(gk) = P(k), RHO(gk) = RHO(k);
-            M(gk) = M(k); // Neumann boundary
-            TYPE(gk) = -2, HSML(gk) = H;
+            compact_block ( n_near_wall, &begin, &end );
+            for ( int_t c=begin; c<end; c++ )
+                count += ghost_count ( near_wall[c], boundary );
         }
+        block[0] = begin, block[1] = end;
+        block[2] = n_real + compact_offset ( count, &total );
+        #pragma omp single
+        n_virt = total;
+    }
+    resize_list ( n_real + n_virt );
 
-        // Vertical mirror bottom
-        if ( Y(k) < boundary )
+    #pragma omp parallel
+    {
+        int_t *block = blocks[omp_get_thread_num()],
+            begin = block[0], end = block[1], next_gk = block[2];
+        for ( int_t c=begin; c<end; c++ )
         {
-            #pragma omp atomic capture
-            current_n_virt = n_virt++;
+            int_t k = near_wall[c];
 
-            int_t gk = n_field + current_n_virt;
-            X(gk) = X(k),  VX(gk) = VX(k);
-            Y(gk) = -Y(k), VY(gk) = -VY(k);
-            P(gk) = P(k), RHO(gk) = RHO(k), M(gk) = M(k);
-            TYPE(gk) = -2, HSML(gk) = H;
-        }
+            // Horizontal mirror left
+            if ( X(k) < boundary )
+            {
+                // Make use of one more list slot as ghost-k
+                int_t gk = next_gk++;
+                X(gk) = -X(k), VX(gk) = -VX(k);
+                Y(gk) = Y(k),  VY(gk) = VY(k);
+                P(gk) = P(k), RHO(gk) = RHO(k), M(gk) = M(k);
+                TYPE(gk) = -2, HSML(gk) = H;
+            }
 
-        // Lower left corner
-        if ( X(k) < boundary && Y(k) < boundary )
-        {
-            #pragma omp atomic capture
-            current_n_virt = n_virt++;
+            // Horizontal mirror right
+            if ( X(k) > B-boundary )
+            {
+                int_t gk = next_gk++;
+                X(gk) = 2*B-X(k), VX(gk) = -VX(k);
+                Y(gk) = Y(k),     VY(gk) = VY(k);
+                P(gk) = P(k), RHO(gk) = RHO(k);
+                M(gk) = M(k); // Neumann boundary
+                TYPE(gk) = -2, HSML(gk) = H;
+            }
 
-            int_t gk = n_field + current_n_virt;
-            X(gk) = -X(k), VX(gk) = -VX(k);
-            Y(gk) = -Y(k), VY(gk) = -VY(k);
-            P(gk) = P(k), RHO(gk) = RHO(k), M(gk) = M(k);
-            TYPE(gk) = -2, HSML(gk) = H;
-        }
+            // Vertical mirror bottom
+            if ( Y(k) < boundary )
+            {
+                int_t gk = next_gk++;
+                X(gk) = X(k),  VX(gk) = VX(k);
+                Y(gk) = -Y(k), VY(gk) = -VY(k);
+                P(gk) = P(k), RHO(gk) = RHO(k), M(gk) = M(k);
+                TYPE(gk) = -2, HSML(gk) = H;
+            }
 
-        // Lower right corner
-        if ( X(k) > B-boundary && Y(k) < boundary )
-        {
-            #pragma omp atomic capture
-            current_n_virt = n_virt++;
+            // Lower left corner
+            if ( X(k) < boundary && Y(k) < boundary )
+            {
+                int_t gk = next_gk++;
+                X(gk) = -X(k), VX(gk) = -VX(k);
+                Y(gk) = -Y(k), VY(gk) = -VY(k);
+                P(gk) = P(k), RHO(gk) = RHO(k), M(gk) = M(k);
+                TYPE(gk) = -2, HSML(gk) = H;
+            }
 
-            int_t gk = n_field + current_n_virt;
-            X(gk) = 2*B-X(k), VX(gk) = -VX(k);
-            Y(gk) = -Y(k),    VY(gk) = -VY(k);
-            P(gk) = P(k), RHO(gk) = RHO(k), M(gk) = M(k);
-            TYPE(gk) = -2, HSML(gk) = H;
+            // Lower right corner
+            if ( X(k) > B-boundary && Y(k) < boundary )
+            {
+                int_t gk = next_gk++;
+                X(gk) = 2*B-X(k), VX(gk) = -VX(k);
+                Y(gk) = -Y(k),    VY(gk) = -VY(k);
+                P(gk) = P(k), RHO(gk) = RHO(k), M(gk) = M(k);
+                TYPE(gk) = -2, HSML(gk) = H;
+            }
         }
     }
 }
@@ -848,7 +1737,7 @@ initialize ( void )
                 y = H + i * DELTA;
             if ( x >= subdomain[0] && x < subdomain[1] )
             {
-                particle_t *p = malloc(sizeof(particle_t));
+                particle_t *p = calloc(1, sizeof(particle_t));
                 p->idx = k;
                 p->x[0] = x;
                 p->x[1] = y;
@@ -867,14 +1756,8 @@ initialize ( void )
     n_field = n_particles();
 
     // Initial allocation for the lists of local particles and pairs
-    list = (particle_t *) malloc ( n_capacity * sizeof(particle_t) );
-    pairs = malloc ( n_pair_cap * sizeof(pair_t) );
-
-    /* Create buckets */
-    buckets = (bucket_t**)malloc(sizeof(bucket_t*) * N_BUCKETS_X * N_BUCKETS_Y);
-    for (int i = 0; i < N_BUCKETS_X*N_BUCKETS_Y; ++i) {
-        buckets[i] = (bucket_t*)malloc(sizeof(bucket_t));
-    }
+    list = numa_alloc ( n_capacity * sizeof(particle_t) );
+    pairs = numa_alloc ( n_pair_cap * sizeof(pair_t) );
 }
 
 
@@ -882,15 +1765,81 @@ void
 finalize ( void )
 {
     particles_finalize ();
-    free ( list );
-    free ( pairs );
-    free(buckets);
+    numa_free ( list );
+    numa_free ( pairs );
+#ifdef CSR_PAIRS
+    free ( neighbors );
+    free ( pair_values );
+    free ( neighbor_offset );
+    free ( row_end );
+    neighbors = NULL, pair_values = NULL;
+    neighbor_offset = row_end = NULL;
+    n_neighbor_cap = n_offset_cap = 0;
+#endif //CSR_PAIRS
+#ifdef BUCKET
+#ifdef FILL_BUCKETS_LOCK
+    for ( int_t s=0; s<n_bucket_slots; s++ )
+        omp_destroy_lock ( &(bucket_locks[s]) );
+    free ( bucket_locks );
+    bucket_locks = NULL;
+#endif //FILL_BUCKETS_LOCK
+    free ( buckets );
+    free ( occupied_buckets );
+    free ( next_in_bucket );
+    buckets = NULL, n_bucket_slots = n_bucket_cap = 0;
+    occupied_buckets = next_in_bucket = NULL;
+    for ( int t=0; t<n_pair_buffers; t++ )
+        free ( pair_buffers[t].pairs );
+    free ( pair_buffers );
+    pair_buffers = NULL, n_pair_buffers = 0;
+#endif //BUCKET
+    free ( near_wall );
+    near_wall = NULL, n_near_wall = n_near_wall_cap = 0;
+    free ( compact_counts );
+    compact_counts = NULL, n_compact_counts = 0;
+#ifndef NO_MPI
+    free ( halo_scratch );
+    free ( halo_index );
+    halo_scratch = halo_index = NULL, n_halo_index_cap = 0;
+#endif //NO_MPI
+#ifdef BLOCK_STEP
+    free ( active );
+    free ( wake );
+    active = NULL, wake = NULL, n_active_cap = 0;
+#endif //BLOCK_STEP
+    diag_finalize();
+    aggregate_finalize();
+#ifdef WITH_SHM
+    shm_finalize();
+#endif //WITH_SHM
+#ifdef WITH_PERF
+    perf_finalize();
+#endif //WITH_PERF
+#ifdef WITH_TRACE
+    trace_finalize();
+#endif //WITH_TRACE
+    if ( comm != MPI_COMM_WORLD )
+        MPI_Comm_free ( &comm );
 }
 
 
 /* MPI communication */
 
 
+#ifdef NO_MPI
+/* The one process owns the whole tank: nothing leaves, nothing mirrors */
+void
+migrate_particles ( void )
+{
+}
+
+
+void
+border_exchange ( void )
+{
+    n_mirror = 0;
+}
+#else
 void
 migrate_particles ( void )
 {
@@ -901,37 +1850,46 @@ migrate_particles ( void )
     int_t export_east = 0, export_west = 0, import_east = 0, import_west = 0;
 
     list_particles ( actuals );
-    for ( int_t k=0; k<n_field; k++ )
+    #pragma omp parallel
     {
-        particle_t *p = actuals[k];
-        if ( p->x[0] < subdomain[0] && rank > 0 )
+        int_t begin, end, found_west = 0, found_east = 0, total;
+        compact_block ( n_field, &begin, &end );
+        for ( int_t k=begin; k<end; k++ )
         {
-            remove_particle ( p );
-            move_west[export_west] = p;
-            export_west += 1;
+            particle_t *p = actuals[k];
+            if ( p->x[0] < subdomain[0] && rank > 0 )
+                found_west += 1;
+            else if ( p->x[0] > subdomain[1] && rank < (size-1) )
+                found_east += 1;
         }
-        else if ( p->x[0] > subdomain[1] && rank < (size-1) )
+        int_t
+            at_west = compact_offset ( found_west, &total ),
+            at_east = compact_offset ( found_east, &total );
+        for ( int_t k=begin; k<end; k++ )
         {
-            remove_particle ( p );
-            move_east[export_east] = p;
-            export_east += 1;
+            particle_t *p = actuals[k];
+            if ( p->x[0] < subdomain[0] && rank > 0 )
+                move_west[at_west++] = p;
+            else if ( p->x[0] > subdomain[1] && rank < (size-1) )
+                move_east[at_east++] = p;
         }
-/*
-        if ( p->x[0] < 0.0 )
-            p->x[0] += B;
-        else if ( p->x[0] > B )
-            p->x[0] -= B;
-*/
+        if ( omp_get_thread_num() == omp_get_num_threads()-1 )
+            export_west = at_west, export_east = at_east;
     }
+    // The table is not thread safe
+    for ( int_t k=0; k<export_west; k++ )
+        remove_particle ( move_west[k] );
+    for ( int_t k=0; k<export_east; k++ )
+        remove_particle ( move_east[k] );
     MPI_Sendrecv (
         &export_west, 1, INT_MACRO_MPI, west, 0,
         &import_east, 1, INT_MACRO_MPI, east, 0,
-        MPI_COMM_WORLD, MPI_STATUS_IGNORE
+        comm, MPI_STATUS_IGNORE
     );
     MPI_Sendrecv (
         &export_east, 1, INT_MACRO_MPI, east, 0,
         &import_west, 1, INT_MACRO_MPI, west, 0,
-        MPI_COMM_WORLD, MPI_STATUS_IGNORE
+        comm, MPI_STATUS_IGNORE
     );
 
     // Serialize in/out-bound particles
@@ -953,14 +1911,14 @@ migrate_particles ( void )
         export_west*sizeof(particle_t), MPI_BYTE, west, 0,
         &(inlist[import_west]),
         import_east*sizeof(particle_t), MPI_BYTE, east, 0,
-        MPI_COMM_WORLD, MPI_STATUS_IGNORE
+        comm, MPI_STATUS_IGNORE
     );
     MPI_Sendrecv (
         &(outlist[export_west]),
         export_east*sizeof(particle_t), MPI_BYTE, east, 0,
         &(inlist[0]),
         import_west*sizeof(particle_t), MPI_BYTE, west, 0,
-        MPI_COMM_WORLD, MPI_STATUS_IGNORE
+        comm, MPI_STATUS_IGNORE
     );
 
     for ( int_t k=0; k<(import_west+import_east); k++ )
@@ -981,6 +1939,66 @@ migrate_particles ( void )
 }
 
 
+/* Halo export of both border_exchange(): the list indices of the
+ * particles within halo_width of the west border, then those of the east
+ * border, each in list order. halo_select() finds them in one pass over
+ * the list, halo_pack() copies them out.
+ */
+void
+halo_select ( int_t *export_west, int_t *export_east )
+{
+    int_t n = n_field + n_virt, n_west = 0;
+    if ( n_halo_index_cap < n )
+    {
+        n_halo_index_cap = n;
+        halo_scratch = realloc ( halo_scratch, 2*n * sizeof(int_t) );
+        halo_index = realloc ( halo_index, 2*n * sizeof(int_t) );
+    }
+
+    #pragma omp parallel
+    {
+        int_t begin, end, found_west = 0, found_east = 0, total;
+        compact_block ( n, &begin, &end );
+        int_t
+            *west_found = &(halo_scratch[begin]),
+            *east_found = &(halo_scratch[n+begin]);
+        for ( int_t k=begin; k<end; k++ )
+        {
+            if ( (X(k) - subdomain[0]) < halo_width && rank > 0 )
+                west_found[found_west++] = k;
+            if ( (subdomain[1] - X(k)) < halo_width && rank < size-1 )
+                east_found[found_east++] = k;
+        }
+
+        memcpy ( &(halo_index[compact_offset ( found_west, &total )]),
+            west_found, found_west * sizeof(int_t)
+        );
+        int_t west_total = total;
+        memcpy (
+            &(halo_index[west_total + compact_offset ( found_east, &total )]),
+            east_found, found_east * sizeof(int_t)
+        );
+        #pragma omp master
+        {
+            n_west = west_total;
+            n_halo_index = west_total + total;
+        }
+    }
+    *export_west = n_west;
+    *export_east = n_halo_index - n_west;
+}
+
+
+void
+halo_pack ( particle_t *transfer )
+{
+    #pragma omp parallel for
+    for ( int_t e=0; e<n_halo_index; e++ )
+        memcpy ( &(transfer[e]), &(list[halo_index[e]]), sizeof(particle_t) );
+}
+
+
+#ifndef WITH_SHM
 void
 border_exchange ( void )
 {
@@ -988,27 +2006,18 @@ border_exchange ( void )
         export_east = 0, export_west = 0,
         import_east = 0, import_west = 0;
 
-    // Scan the list and count particles within neighbor reach
-    #pragma omp parallel for
-    for ( int_t k=0; k<(n_field+n_virt); k++ )
-    {
-        if ( (X(k) - subdomain[0]) < scale_k*H && rank>0 )
-            #pragma omp atomic update
-            export_west += 1;
-        if ( (subdomain[1] - X(k)) < scale_k*H && rank<size-1)
-            #pragma omp atomic update
-            export_east += 1;
-    }
+    // Find the particles within neighbor reach
+    halo_select ( &export_west, &export_east );
 
     MPI_Sendrecv (
         &export_west, 1, INT_MACRO_MPI, west, 0,
         &import_east, 1, INT_MACRO_MPI, east, 0,
-        MPI_COMM_WORLD, MPI_STATUS_IGNORE
+        comm, MPI_STATUS_IGNORE
     );
     MPI_Sendrecv (
         &export_east, 1, INT_MACRO_MPI, east, 0,
         &import_west, 1, INT_MACRO_MPI, west, 0,
-        MPI_COMM_WORLD, MPI_STATUS_IGNORE
+        comm, MPI_STATUS_IGNORE
     );
 
     // This transfer list could be glob/resize instead of malloc per iter
@@ -1016,25 +2025,7 @@ border_exchange ( void )
     particle_t *transfer = (particle_t *) malloc (
         (export_west + export_east) * sizeof(particle_t)
     );
-    int_t w_idx = 0, e_idx=export_west;
-    int_t priv_w_idx,  priv_e_idx;
-
-    #pragma omp parallel for private(priv_w_idx, priv_e_idx)
-    for ( int_t k=0; k<(n_field+n_virt); k++ )
-    {
-        if ( (X(k) - subdomain[0]) < scale_k*H && rank > 0)
-        {
-            #pragma omp atomic capture
-            priv_w_idx = w_idx++;
-            memcpy ( &(transfer[priv_w_idx]), &(list[k]), sizeof(particle_t) );
-        }
-        if ( (subdomain[1] - X(k)) < scale_k*H && rank < size-1)
-        {
-            #pragma omp atomic capture
-            priv_e_idx = e_idx++;
-            memcpy ( &(transfer[priv_e_idx]), &(list[k]), sizeof(particle_t) );
-        }
-    }
+    halo_pack ( transfer );
 
     n_mirror = import_east + import_west;
     resize_list ( n_field + n_virt + n_mirror );
@@ -1044,29 +2035,77 @@ border_exchange ( void )
         export_west*sizeof(particle_t), MPI_BYTE, west, 0,
         &(list[n_field+n_virt+import_west]),
         import_east*sizeof(particle_t), MPI_BYTE, east, 0,
-        MPI_COMM_WORLD, MPI_STATUS_IGNORE
+        comm, MPI_STATUS_IGNORE
     );
     MPI_Sendrecv (
         &(transfer[export_west]),
         export_east*sizeof(particle_t), MPI_BYTE, east, 0,
         &(list[n_field+n_virt]),
         import_west*sizeof(particle_t), MPI_BYTE, west, 0,
-        MPI_COMM_WORLD, MPI_STATUS_IGNORE
+        comm, MPI_STATUS_IGNORE
     );
     free ( transfer );
 }
+#endif //WITH_SHM
+#endif //NO_MPI
 
 /* Auxiliary routines - file handling is in sph_io.c */
 
+/* Parallel stream compaction, by all threads of a parallel region: each
+ * thread scans its compact_block() of the input and counts what it keeps,
+ * compact_offset() tells where its output starts. Outputs follow in
+ * thread order, i.e. in input order whatever the schedule.
+ */
+void
+compact_block ( int_t n, int_t *begin, int_t *end )
+{
+    int t = omp_get_thread_num(), n_threads = omp_get_num_threads();
+    *begin = n * t / n_threads;
+    *end = n * (t+1) / n_threads;
+}
+
+
+/* Exclusive scan of the threads' counts, and their total */
+int_t
+compact_offset ( int_t count, int_t *total )
+{
+    int t = omp_get_thread_num(), n_threads = omp_get_num_threads();
+    #pragma omp single
+    if ( n_compact_counts < n_threads )
+    {
+        n_compact_counts = n_threads;
+        compact_counts = realloc ( compact_counts, n_threads * sizeof(int_t) );
+    }
+    compact_counts[t] = count;
+    TRACE_BARRIER ();
+
+    int_t offset = 0;
+    *total = 0;
+    for ( int s=0; s<n_threads; s++ )
+    {
+        if ( s == t )
+            offset = *total;
+        *total += compact_counts[s];
+    }
+    TRACE_BARRIER ();     // Before the next call overwrites the counts
+    return offset;
+}
+
+
 void
 resize_list ( int_t required )
 {
     if ( required >= n_capacity )
     {
-        n_capacity = required;
-        particle_t* new_list = realloc ( list, n_capacity * sizeof(particle_t) );
+        // Growing maps and copies the whole list, leave room to grow into
+        int_t new_cap = required + MAX ( required / 4, CAP_INCREMENT );
+        particle_t* new_list = numa_realloc ( list,
+            n_capacity * sizeof(particle_t), new_cap * sizeof(particle_t),
+            true
+        );
+        n_capacity = new_cap;
         if(new_list == NULL) {
-            free(list);
+            numa_free(list);
             fprintf(stderr, "1Not enough memory!\n");
             exit(1);
         } else {
@@ -1079,11 +2118,16 @@ resize_list ( int_t required )
 void
 resize_pair_list ( int_t new_cap )
 {
+    // Every caller refills the pairs, which are first written by the
+    // threads that find them. The all-pairs search reserves far more
+    // than it uses, copying or touching it all would commit it.
+    pair_t* new_pairs = numa_realloc ( pairs, 0, new_cap * sizeof(pair_t),
+        false
+    );
     n_pair_cap = new_cap;
-    pair_t* new_pairs = realloc ( pairs, n_pair_cap * sizeof(pair_t) );
     if(new_pairs == NULL) {
         fprintf(stderr, "2Not enough memory!\n");
-        free(pairs);
+        numa_free(pairs);
         exit(1);
     } else {
         pairs = new_pairs;
@@ -1091,14 +2135,201 @@ resize_pair_list ( int_t new_cap )
 }
 
 
+/* Ensemble mode: split the ranks evenly between the members listed in
+ * 'filename' (read on the master), one line of problem settings each.
+ * Every member runs an independent simulation on its own communicator,
+ * the per-process solver state only ever sees that one. Output goes to
+ * plot/<member>/
+ */
+static void
+ensemble_split ( char *filename )
+{
+    long length = 0;
+    char *text = NULL;
+    if ( rank == 0 )
+    {
+        FILE *in = fopen ( filename, "r" );
+        if ( in == NULL )
+        {
+            fprintf ( stderr, "Error: unable to open '%s', aborting\n",
+                filename
+            );
+            MPI_Abort ( MPI_COMM_WORLD, ENOENT );
+        }
+        fseek ( in, 0, SEEK_END );
+        length = ftell ( in );
+        rewind ( in );
+        text = malloc ( length+1 );
+        length = fread ( text, 1, length, in );
+        text[length] = '\0';
+        fclose ( in );
+    }
+    MPI_Bcast ( &length, 1, MPI_LONG, 0, MPI_COMM_WORLD );
+    if ( rank != 0 )
+        text = malloc ( length+1 );
+    MPI_Bcast ( text, length+1, MPI_CHAR, 0, MPI_COMM_WORLD );
+
+    /* Members are the lines with settings on them */
+    char *lines[length+1], *save_line;
+    int n_members = 0;
+    for ( char *line = strtok_r ( text, "\n", &save_line ); line != NULL;
+        line = strtok_r ( NULL, "\n", &save_line ) )
+    {
+        line[strcspn ( line, "#" )] = '\0';  // Strip comments
+        if ( strspn ( line, " \t" ) != strlen ( line ) )
+            lines[n_members++] = line;
+    }
+    if ( n_members == 0 || (size % n_members) != 0 )
+    {
+        if ( rank == 0 )
+            fprintf ( stderr, "Error: %d ranks can not be split evenly "
+                "between %d ensemble members, aborting\n", size, n_members
+            );
+        MPI_Abort ( MPI_COMM_WORLD, EINVAL );
+    }
+    if ( rank == 0 )
+        printf ( "Ensemble: %d members of %d ranks\n",
+            n_members, size / n_members
+        );
+
+    int member = rank / (size / n_members);
+    MPI_Comm_split ( MPI_COMM_WORLD, member, rank, &comm );
+    MPI_Comm_rank ( comm, &rank );
+    MPI_Comm_size ( comm, &size );
+
+    /* Member settings override the common ones */
+    bool valid = true;
+    char *save_setting;
+    for ( char *setting = strtok_r ( lines[member], " \t", &save_setting );
+        setting != NULL; setting = strtok_r ( NULL, " \t", &save_setting ) )
+        if ( !problem_parameter ( setting ) )
+        {
+            if ( rank == 0 )
+                fprintf ( stderr, "Error: bad setting '%s' for ensemble "
+                    "member %d\n", setting, member
+                );
+            valid = false;
+        }
+    free ( text );
+    if ( !valid )
+        MPI_Abort ( MPI_COMM_WORLD, EINVAL );
+
+    /* Members get a directory each, their master logs to a file there */
+    sprintf ( output_dir, "plot/%.3d", member );
+    if ( rank == 0 )
+    {
+        char log[300];
+        sprintf ( log, "%s/sph.log", output_dir );
+        if ( ( mkdir ( output_dir, 0755 ) != 0 && errno != EEXIST )
+            || freopen ( log, "w", stdout ) == NULL )
+        {
+            fprintf ( stderr, "Error: unable to create '%s', aborting\n",
+                log
+            );
+            MPI_Abort ( MPI_COMM_WORLD, EIO );
+        }
+    }
+    MPI_Barrier ( comm );
+}
+
+
+/* Set what views hold from a 'key=value' string */
+static bool
+view_parameter ( char *key_value )
+{
+    static const struct { const char *name; int field; } fields[] = {
+        { "idx", VIEW_IDX }, { "x", VIEW_X }, { "v", VIEW_V },
+        { "rho", VIEW_RHO }, { "p", VIEW_P }
+    };
+    char key[64], text[128];
+    if ( sscanf ( key_value, " %63[^= \t] = %127s", key, text ) != 2 )
+        return false;
+    if ( strcmp ( key, "box" ) == 0 )
+        return sscanf ( text, "%lf,%lf,%lf,%lf", &view.box[0], &view.box[1],
+            &view.box[2], &view.box[3] ) == 4;
+    if ( strcmp ( key, "stride" ) == 0 )
+    {
+        view.stride = strtol ( text, NULL, 10 );
+        return view.stride > 0;
+    }
+    if ( strcmp ( key, "fields" ) == 0 )
+    {
+        view.fields = 0;
+        for ( char *name = strtok ( text, "," ); name != NULL;
+            name = strtok ( NULL, "," ) )
+        {
+            size_t f = 0;
+            while ( f < sizeof(fields)/sizeof(fields[0])
+                && strcmp ( name, fields[f].name ) != 0 )
+                f++;
+            if ( f == sizeof(fields)/sizeof(fields[0]) )
+                return false;
+            view.fields |= fields[f].field;
+        }
+        return view.fields != 0;
+    }
+    return false;
+}
+
+
+/* Read problem parameters from '-p' options and '-f' files on the master
+ * rank, share them with everyone, apply ensemble member settings and
+ * derive the ones left unset
+ */
+static void
+problem_options ( char *settings[], int n_settings, char *filename,
+    bool in_ensemble, char *ensemble )
+{
+    if ( rank == 0 )
+    {
+        int status = problem_read ( filename, settings, n_settings );
+        if ( status != 0 )
+            MPI_Abort ( comm, status );
+    }
+    MPI_Bcast ( &problem, sizeof(problem_t), MPI_BYTE, 0, comm );
+
+    if ( in_ensemble )
+        ensemble_split ( ensemble );
+
+    /* Derived on all ranks alike, only the master reports */
+#ifdef FIXED_SCALE_K
+    if ( problem.kernel_support != FIXED_SCALE_K && rank == 0 )
+        fprintf ( stderr, "Warning: scale_k is fixed to %lf at compile "
+            "time, ignoring %lf\n", FIXED_SCALE_K, problem.kernel_support
+        );
+    problem.kernel_support = FIXED_SCALE_K;
+#endif //FIXED_SCALE_K
+
+    problem_derive ();
+    dt = problem.dt;
+
+    if ( rank == 0 )
+    {
+        if ( scale_k < kernels[problem.kernel].support )
+            fprintf ( stderr, "Warning: scale_k %lf truncates the %s "
+                "kernel, which has support %.0lfH\n", scale_k,
+                kernels[problem.kernel].name, kernels[problem.kernel].support
+            );
+        printf ( "Problem: scale=%lf T=%lf L=%lf B=%lf DELTA=%lf H=%lf "
+            "dt=%e sos=%lf scale_k=%lf kernel=%s\n",
+            SCALE, T, L, B, DELTA, H, problem.dt, sos, scale_k,
+            kernels[problem.kernel].name
+        );
+    }
+}
+
+
 void
 options ( int argc, char **argv )
 {
+    char *settings[argc], *filename = NULL, *ensemble = NULL, frames[32] = "";
+    int n_settings = 0;
+
     /* Master rank parses command line options */
     if ( rank == 0 )
     {
         int o;
-        while ( (o = getopt(argc,argv,"i:c:r:")) != -1 )
+        while ( (o = getopt(argc,argv,"i:c:r:k:a:p:f:e:s:d:g:v:o:A:Mw:")) != -1 )
         switch ( o )
         {
             case 'i':
@@ -1112,19 +2343,121 @@ options ( int argc, char **argv )
             case 'r':
                 min_iteration = strtol(optarg,NULL,10);
                 break;
+            case 'k':
+                halo_depth_max = MAX ( 1, strtol(optarg,NULL,10) );
+                break;
+            case 'a':
+                courant = strtod(optarg,NULL);
+                break;
+            case 'p':
+                settings[n_settings++] = optarg;
+                break;
+            case 'f':
+                filename = optarg;
+                break;
+            case 'e':
+                ensemble = optarg;
+                break;
+            case 's':
+                snapshot_step = strtol(optarg,NULL,10);
+                break;
+            case 'd':
+                diag_frequency = strtol(optarg,NULL,10);
+                break;
+            case 'g':
+                strncpy ( frames, optarg, sizeof(frames)-1 );
+                break;
+            case 'v':
+                view_frequency = strtol(optarg,NULL,10);
+                break;
+            case 'o':
+                if ( !view_parameter ( optarg ) )
+                {
+                    fprintf ( stderr, "Error: bad view setting '%s'\n",
+                        optarg
+                    );
+                    MPI_Abort ( MPI_COMM_WORLD, EINVAL );
+                }
+                break;
+            case 'A':
+                aggregate.group = ( strcmp ( optarg, "node" ) == 0 )
+                    ? AGGREGATE_NODE : MAX ( 0, strtol(optarg,NULL,10) );
+                break;
+            case 'M':
+                aggregate.subfiles = true;
+                break;
+            case 'w':
+            {
+                /* Stripe size in bytes, or with a k/m suffix */
+                char *unit;
+                aggregate.stripe = strtol ( optarg, &unit, 10 );
+                if ( *unit == 'k' || *unit == 'K' )
+                    aggregate.stripe <<= 10;
+                else if ( *unit == 'm' || *unit == 'M' )
+                    aggregate.stripe <<= 20;
+                if ( aggregate.stripe <= 0 )
+                {
+                    fprintf ( stderr, "Error: bad stripe size '%s'\n",
+                        optarg
+                    );
+                    MPI_Abort ( MPI_COMM_WORLD, EINVAL );
+                }
+                break;
+            }
+        }
+        /* Subfiles come from aggregators, one per node unless set */
+        if ( aggregate.subfiles && aggregate.group == 0 )
+            aggregate.group = AGGREGATE_NODE;
+        if ( min_iteration != MIN_ITERATION_DEFAULT
+            && checkpoint_frequency <= 0 )
+        {
+            fprintf ( stderr, "Restarts need the checkpoint frequency "
+                "of the run they restart (-c)\n"
+            );
+            MPI_Abort ( MPI_COMM_WORLD, EINVAL );
         }
     }
 
     /* Communicate option flags to the rest of the collective */
     MPI_Bcast ( &min_iteration, 1, INT_MACRO_MPI, 0,
-        MPI_COMM_WORLD
+        comm
     );
     MPI_Bcast ( &max_iteration, 1, INT_MACRO_MPI, 0,
-        MPI_COMM_WORLD
+        comm
     );
     MPI_Bcast ( &checkpoint_frequency, 1, INT_MACRO_MPI, 0,
-        MPI_COMM_WORLD
+        comm
     );
+    MPI_Bcast ( &halo_depth_max, 1, INT_MACRO_MPI, 0,
+        comm
+    );
+    MPI_Bcast ( &courant, 1, REAL_MACRO_MPI, 0,
+        comm
+    );
+    MPI_Bcast ( &snapshot_step, 1, INT_MACRO_MPI, 0,
+        comm
+    );
+    MPI_Bcast ( &diag_frequency, 1, INT_MACRO_MPI, 0,
+        comm
+    );
+    MPI_Bcast ( &view_frequency, 1, INT_MACRO_MPI, 0,
+        comm
+    );
+    MPI_Bcast ( &view, sizeof(view_t), MPI_BYTE, 0, comm );
+    MPI_Bcast ( &aggregate, sizeof(aggregate_t), MPI_BYTE, 0, comm );
+    MPI_Bcast ( frames, sizeof(frames), MPI_CHAR, 0, comm );
+    bool in_ensemble = ( ensemble != NULL );
+    MPI_Bcast ( &in_ensemble, 1, MPI_C_BOOL, 0, comm );
+    problem_options ( settings, n_settings, filename, in_ensemble, ensemble );
+    if ( frames[0] != '\0'
+        && !raster_setup ( &frame, frames, FRAME_WIDTH, B, T, DELTA ) )
+    {
+        if ( rank == 0 )
+            fprintf ( stderr, "Unknown frame field '%s', "
+                "use dots, pressure or speed (':ppm' for PPM)\n", frames
+            );
+        MPI_Abort ( MPI_COMM_WORLD, EINVAL );
+    }
     if ( min_iteration != MIN_ITERATION_DEFAULT )
         restart = true;
 }
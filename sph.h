@@ -10,7 +10,11 @@
 #include <stdbool.h>
 #include <string.h>
 #include <math.h>
+#ifdef NO_MPI
+#include "mpi_stub.h"
+#else
 #include <mpi.h>
+#endif //NO_MPI
 #include <omp.h>
 #include <getopt.h>
 #include <unistd.h>
@@ -19,50 +23,156 @@
 #define MIN_ITERATION_DEFAULT 0
 #define MAX_ITERATION_DEFAULT 200000
 #define CHECKPOINT_FREQUENCY_DEFAULT 200
+#define HALO_DEPTH_DEFAULT 1
+#define DT_DEFAULT (1e-4)
 
-/* Problem parameters */
+// Block time steps: deepest level, particles step at most dt*2^MAX_LEVEL,
+// and the Courant number of the per-particle step limit
+#ifndef MAX_LEVEL
+    #define MAX_LEVEL 3
+#endif //MAX_LEVEL
+#ifndef BLOCK_COURANT
+    #define BLOCK_COURANT (0.4)
+#endif //BLOCK_COURANT
 
-// Scale coefficient selects problem size
-#ifndef SCALE
-    #define SCALE (1.0)
-#endif //SCALE
+typedef int64_t int_t;
+#define INT_MACRO_MPI MPI_LONG
+typedef double real_t;
+#define REAL_MACRO_MPI MPI_DOUBLE
 
-// Height of dam
-#define T (0.6 * SCALE)
+/* Stored particle state (velocity, density, pressure) and pair kernel
+ * values are single precision with -DMIXED_PRECISION. Positions and the
+ * accumulated differentials stay real_t, arithmetic on stored values is
+ * done in real_t and only rounded when the result is stored.
+ */
+#ifdef MIXED_PRECISION
+typedef float store_t;
+#else
+typedef real_t store_t;
+#endif //MIXED_PRECISION
 
-// Width of dam
-#define L (1.2 * SCALE)
+/* Smoothing kernels, chosen at run time with '-p kernel=name' (in sph.c) */
+typedef enum {
+    KERNEL_QUINTIC,     // Quintic spline, support 3H (quintic)
+    KERNEL_CUBIC,       // Cubic spline, support 2H (cubic)
+    KERNEL_WENDLAND2,   // Wendland C2, support 2H (wendland2)
+    KERNEL_WENDLAND4,   // Wendland C4, support 2H (wendland4)
+    N_KERNELS
+} kernel_t;
+typedef struct {
+    const char *name;
+    real_t support;     // Radius in units of H
+    real_t norm;        // Normalization in 2D, times H^2
+} kernel_info_t;
 
-// Size of tank
-#define B (3.22 * SCALE)
+/* Problem parameters, set at run time with '-p key=value' or from a file
+ * of 'key = value' lines with '-f file' (keys in parentheses)
+ */
+typedef struct {
+    real_t
+        scale,          // Scale coefficient selects problem size (scale)
+        height,         // Height of dam, 0.6*scale (T)
+        width,          // Width of dam, 1.2*scale (L)
+        tank,           // Size of tank, 3.22*scale (B)
+        delta,          // Resolution, 0.01 (DELTA)
+        h,              // Smoothing length, 0.94*DELTA*sqrt(2) (H)
+        dt,             // Time step, the first one if adaptive (dt)
+        sound_speed,    // Speed of sound, 50.0 (sos)
+        kernel_support; // Interaction radius in units of H, that of the
+                        // kernel by default (scale_k)
+    kernel_t kernel;    // Smoothing kernel, quintic (kernel)
+} problem_t;
+extern problem_t problem;
 
-// Resolution
-#define DELTA (0.01)
-#define H (0.94*DELTA*1.4142135623)
+// Default scale, can still be given at compile time
+#ifndef SCALE_DEFAULT
+    #define SCALE_DEFAULT (1.0)
+#endif //SCALE_DEFAULT
 
-typedef int64_t int_t;
-#define INT_MACRO_MPI MPI_LONG
-typedef double real_t;
-#define REAL_MACRO_MPI MPI_DOUBLE
+#define SCALE   (problem.scale)
+#define T       (problem.height)
+#define L       (problem.width)
+#define B       (problem.tank)
+#define DELTA   (problem.delta)
+#define H       (problem.h)
+#define sos     (problem.sound_speed)
 
-#define BID(X,Y) (Y + N_BUCKETS_Y * X)
+// Opt-in fast path, a compile-time kernel support is folded into the
+// neighbor search and bucket arithmetic
+#ifdef FIXED_SCALE_K
+static const real_t scale_k = FIXED_SCALE_K;
+#else
+#define scale_k (problem.kernel_support)
+#endif //FIXED_SCALE_K
 
 #define RADIUS (scale_k * H)
 #define BUCKET_RADIUS (1*RADIUS)
+// Buckets are keyed by their integer coordinates, and hashed into a table
+#define BUCKET_KEY(x,y) ((int64_t)(((uint64_t)(uint32_t)(x) << 32) | (uint32_t)(y)))
+#define BUCKET_X(key) ((int32_t)((uint64_t)(key) >> 32))
+#define BUCKET_Y(key) ((int32_t)((uint64_t)(key) & 0xffffffff))
+#define BUCKET_HASH(key) ((int_t)((((uint64_t)(key) * 0x9E3779B97F4A7C15ULL) >> 32) & (n_bucket_slots - 1)))
+#define EMPTY_BUCKET INT64_MIN
+// Tasks of the neighbor search take runs of SEARCH_BLOCK^2 occupied buckets
+#ifndef SEARCH_BLOCK
+    #define SEARCH_BLOCK 4
+#endif //SEARCH_BLOCK
+
+
+
+/* Global barriers only serve to give clean phase timings, the solver is
+ * ordered by neighbor communication alone. Build with -DNO_BARRIER for
+ * production runs, phase timers then measure per-rank time incl. waiting.
+ */
+#ifdef NO_BARRIER
+#define TIMING_BARRIER()
+#else
+#define TIMING_BARRIER() MPI_Barrier ( comm )
+#endif //NO_BARRIER
 
-#define N_BUCKETS_X ((int_t)(ceil(((subdomain[1]-subdomain[0])+2*RADIUS) / BUCKET_RADIUS))) //RADIUS is the maximum distance (from each sides of the subdomain boundaries) where the mirror particles can be located. RADIUS>1.55*H (otherwise replace RADIUS by 1.55*H when computing N_BUCKETS_X)
-#define N_BUCKETS_Y ((int_t)(ceil(((1.5*T)+1.55*H) / BUCKET_RADIUS))) //1.55*H is the boundary used when generating virtual particles
+/* Hardware counters per phase with -DWITH_PERF (in sph_perf.c), the
+ * phases are those of the t_* timers
+ */
+enum {
+    PERF_GENERATE, PERF_BORDER, PERF_TIMESTEP, PERF_MIGRATE, PERF_IO,
+    PERF_FIND_NEIGHBORS, PERF_PHASES
+};
+#define PERF_EVENTS 4
+#ifdef WITH_PERF
+#define PERF_BEGIN(phase) perf_begin ( phase )
+#define PERF_END(phase) perf_end ( phase )
+#else
+#define PERF_BEGIN(phase)
+#define PERF_END(phase)
+#endif //WITH_PERF
 
+/* Per-thread timeline of OpenMP regions and MPI calls with -DWITH_TRACE
+ * (in sph_trace.c). Spans are named by string literals, worksharing
+ * loops end 'nowait' followed by TRACE_BARRIER() so that the time spent
+ * waiting shows as a span of its own.
+ */
+#ifndef TRACE_EVENTS
+#define TRACE_EVENTS 65536      // Spans kept per thread
+#endif
+#ifdef WITH_TRACE
+#define TRACE_BEGIN(span) double span = trace_time ()
+#define TRACE_END(span, name) trace_event ( name, span )
+#define TRACE_BARRIER() do {                            \
+        double trace_barrier_ = trace_time ();          \
+        _Pragma("omp barrier")                          \
+        trace_event ( "barrier", trace_barrier_ );      \
+    } while ( 0 )
+#else
+#define TRACE_BEGIN(span)
+#define TRACE_END(span, name)
+#define TRACE_BARRIER() _Pragma("omp barrier")
+#endif //WITH_TRACE
 
 #define MIN(X, Y) ((X) < (Y) ? (X) : (Y))
 #define MAX(X, Y) ((X) > (Y) ? (X) : (Y))
 
 static const real_t
-    D_tank = 1.0 * SCALE,
-    scale_k = 3.0,
-    density = 1e3,
-    dt = 1e-4,
-    sos = 50.0;
+    density = 1e3;
 
 static const int_t
     free_surface = 30;
@@ -72,11 +182,15 @@ typedef struct {
         idx,
         interactions;
     real_t
-        x[2],   // 2D position
-        v[2],   // 2D velocity
-        mass,   // Mass
+        x[2];   // 2D position
+    store_t
+        v[2];   // 2D velocity
+    real_t
+        mass;   // Mass
+    store_t
         rho,    // Density
-        p,      // Pressure
+        p;      // Pressure
+    real_t
         type,   // Type of particle
         hsml;   // Related to resolution (not fully understood yet)
 
@@ -95,8 +209,60 @@ typedef struct {
     int_t bucket_y;
     int_t local_idx;
 #endif //BUCKET
+#ifdef BLOCK_STEP
+    int_t level;    // Block time step level, steps by dt*2^level
+#endif //BLOCK_STEP
 } particle_t;
 
+/* Views (-v) are visualization output of part of the particles: those
+ * in a box, every stride'th one by idx, and some of their fields. Set
+ * with '-o key=value' (keys in parentheses). A view file holds one
+ * record of real_t per particle, the fields in the order below, idx and
+ * position alone by default, as (idx, x, y) triples.
+ */
+enum {
+    VIEW_IDX = 1,   // Particle index (idx)
+    VIEW_X = 2,     // Position, 2 values (x)
+    VIEW_V = 4,     // Velocity, 2 values (v)
+    VIEW_RHO = 8,   // Density (rho)
+    VIEW_P = 16     // Pressure (p)
+};
+
+typedef struct {
+    real_t box[4];  // x0, y0, x1, y1, everything by default (box)
+    int_t stride;   // Every stride'th particle, 1 (stride)
+    int fields;     // VIEW_* bits (fields, a list like 'idx,x,p')
+} view_t;
+
+/* Aggregated checkpoint output (-A n, or -A node for one aggregator per
+ * node), into the shared file or one subfile per aggregator (-M), in
+ * writes cut at multiples of the stripe size (-w)
+ */
+#define AGGREGATE_NODE (-1)
+#define AGGREGATE_STRIPE_DEFAULT ((int_t)1 << 20)
+
+typedef struct {
+    int group;          // Ranks per aggregator, 0 for none (-A)
+    bool subfiles;      // NNNN.dat.GGGG per aggregator, NNNN.idx (-M)
+    int_t stripe;       // Bytes, writes do not cross multiples of it (-w)
+} aggregate_t;
+
+/* Frames, '-g field[:ppm]' for the solver and the raster tool */
+typedef enum {
+    RASTER_DOTS,        // Particles only (dots)
+    RASTER_PRESSURE,    // Colored by pressure (pressure)
+    RASTER_SPEED        // Colored by speed (speed)
+} raster_field_t;
+
+typedef struct {
+    int width, height;      // Pixels
+    int radius;             // Particles are discs of this radius in pixels
+    real_t x_max, y_max;    // Area shown, from the origin
+    real_t top;             // Value at the top of the color scale
+    raster_field_t field;
+    bool ppm;               // PPM instead of PNG
+} raster_t;
+
 #define X(k)        ((list[k]).x[0])
 #define Y(k)        ((list[k]).x[1])
 #define VX(k)       ((list[(k)]).v[0])
@@ -116,30 +282,79 @@ typedef struct {
 #define AVRHO(k)    ((list[(k)]).avrho)
 #define WSUM(k)     ((list[(k)]).w_sum)
 
+// Block time steps: only active particles get interactions and kicks
+#ifdef BLOCK_STEP
+#define LEVEL(k)    ((list[(k)]).level)
+#define ACTIVE(k)   (active[(k)])
+#define STEP(k)     (dt * (1 << LEVEL(k)))
+#else
+#define ACTIVE(k)   (true)
+#define STEP(k)     (dt)
+#endif //BLOCK_STEP
+
 // Pairwise interaction
 typedef struct {
     int_t i, j;     // Which particles interact?
+#ifndef CSR_PAIRS
 #ifdef BUCKET
     particle_t* ip;
     particle_t* jp;
 #endif //BUCKET
     real_t
         r,          // Distance between particles (Euclid)
-        q,          // Distance normalized to H (resolution)
+        q;          // Distance normalized to H (resolution)
+    store_t
         w,          // TODO: consult paper for meaning of this
         dwdx[2];    // Influence on velocity
+#endif //CSR_PAIRS
 } pair_t;
 
-typedef struct bucket_t bucket_t;
-/* A bucket is a node in a linked list */
-struct bucket_t{
-    particle_t *particle;
-    bucket_t *next;
-};
+/* With -DCSR_PAIRS the pairs only say who interacts (i < j), the kernel
+ * values are kept apart, and per-particle neighbor lists (compressed
+ * sparse rows) refer to both. Each pair is in the rows of both its
+ * particles, so the solver loops run over particles without atomics.
+ * -DCSR_FLOAT stores the kernel values in single precision, as does
+ * -DMIXED_PRECISION.
+ */
+#ifdef CSR_PAIRS
+#ifdef CSR_FLOAT
+typedef float csr_real_t;
+#else
+typedef store_t csr_real_t;
+#endif //CSR_FLOAT
+typedef struct {
+    int32_t j;                  // List index of the neighbor
+    int32_t pair;               // Index of the pair and its kernel values
+} neighbor_t;
+typedef struct {
+    csr_real_t w, dwdx[2];      // Kernel and its gradient along X(i)-X(j)
+} pair_value_t;
+#endif //CSR_PAIRS
+
+/* A bucket is a slot in the hash table of occupied buckets, heading the
+ * chain of its particles' list indices
+ */
+typedef struct {
+    int64_t key;    // BUCKET_KEY of its coordinates, EMPTY_BUCKET if unused
+    int_t head;     // First particle, the rest follow in next_in_bucket
+} bucket_t;
+
+/* Pairs and interaction counts found by one thread in the bucket search,
+ * padded so that neighboring threads' counters don't share a cache line
+ */
+typedef struct {
+    pair_t *pairs;
+    int_t *interactions;
+    int_t n_pairs, capacity, offset;
+    char pad[64 - 2*sizeof(void *) - 3*sizeof(int_t)];
+} pair_buffer_t;
 
 /* Global state variables, definitions are in sph.c */
 extern int size, rank, east, west;
+extern MPI_Comm comm;
+extern char output_dir[];
 extern int_t n_global_field, n_field;
+extern real_t dt;
 
 /* Setup and takedown */
 void initialize ( void );
@@ -165,30 +380,99 @@ void unmarshal_particles ( particle_t *list, int_t count );
 int_t n_particles ( void );
 
 // I/O and auxiliary stuff
+extern view_t view;
 void dump_state ( char *filename );
 void resize_list ( int_t required );
 void resize_pair_list ( int_t new_cap );
 void collect_checkpoint ( void );
 void write_checkpoint ( char *filename );
 void restart_checkpoint ( int_t iteration );
+void dump_snapshot ( int_t step );
+int_t load_snapshot ( char *filename );
 void options ( int argc, char **argv );
-void free_buckets(bucket_t* bucket);
 void print_timing(char* full_string, char* short_string, double value);
 
 // Parts of the solver
+void time_integration ( void );
+void find_near_wall ( real_t margin );
 void generate_virtual_particles ( void );
-void create_pairs(int bx, int by, bucket_t** buckets,
-                  particle_t* particle, int_t* n_pairs,
-                  int_t* interactions);
-void create_pairs_old(int bx, int by, bucket_t* buckets,
-                      particle_t* particle, int_t* n_pairs);
+void find_neighbors ( void );
+#ifdef CSR_PAIRS
+void build_neighbor_lists ( void );
+#endif //CSR_PAIRS
+#ifdef BUCKET
+void find_neighbors_buckets_ws ( void );
+#endif //BUCKET
+void kernel ( void );
+void cont_density ( void );
+void correction ( void );
+void ext_force ( void );
+void int_force ( void );
+void time_step ( int_t timestep );
+void max_motion ( real_t *v_max, real_t *a_max );
+void adapt_time_step ( real_t v_max, real_t a_max );
+void choose_halo_depth ( real_t v_max, real_t a_max );
+#ifdef BUCKET
+extern int_t n_bucket_slots;
+void create_pairs(particle_t* particle, int_t head, pair_buffer_t* buffer);
 #ifdef FILL_BUCKETS_LOCK
-static void fill_buckets2(bucket_t**, int, omp_lock_t* lock);
+static void fill_buckets2(int_t);
 #else
-static void fill_buckets1(bucket_t**, int);
+static void fill_buckets1(int_t);
 #endif //FILL_BUCKETS_LOCK
+#endif //BUCKET
 
 
 // MPI communication
 void border_exchange( void );
 void migrate_particles ( void );
+void halo_select ( int_t *export_west, int_t *export_east );
+void halo_pack ( particle_t *transfer );
+// Parallel stream compaction, called by all threads of a parallel region
+void compact_block ( int_t n, int_t *begin, int_t *end );
+int_t compact_offset ( int_t count, int_t *total );
+// Hardware counters (in sph_perf.c)
+void perf_init ( void );
+void perf_begin ( int phase );
+void perf_end ( int phase );
+void perf_report ( void );
+void perf_finalize ( void );
+// Thread timeline (in sph_trace.c)
+void trace_init ( void );
+void trace_finalize ( void );
+double trace_time ( void );
+void trace_event ( const char *name, double begin );
+// In-situ diagnostics (in sph_diag.c)
+extern int_t diag_frequency;
+void diag_init ( void );
+void diag_sample ( int_t step );
+void diag_finalize ( void );
+// Frames drawn from particles (in sph_raster.c)
+bool raster_setup ( raster_t *r, const char *spec, int width,
+    real_t tank, real_t height, real_t delta );
+void raster_splat ( const raster_t *r, const particle_t *particles, int_t n,
+    float *grid );
+int raster_write ( const raster_t *r, const float *grid, const char *filename );
+void write_frame ( char *filename );
+// Aggregated checkpoint output (in sph_agg.c)
+extern aggregate_t aggregate;
+void aggregate_init ( void );
+void aggregate_finalize ( void );
+void aggregate_write ( char *filename, particle_t *particles, int_t n,
+    int_t first );
+// Problem setup and checkpoint files, MPI-free for the tools (in sph_setup.c)
+extern const kernel_info_t kernels[N_KERNELS];
+bool problem_parameter ( char *key_value );
+int problem_read ( const char *filename, char *settings[], int n_settings );
+void problem_derive ( void );
+void aggregate_index_name ( char *index, const char *filename );
+int aggregate_parts ( const char *filename, char (**parts)[256] );
+// First touch placement and thread bindings (in sph_numa.c)
+void *numa_alloc ( size_t bytes );
+void *numa_realloc ( void *old, size_t old_bytes, size_t new_bytes,
+    bool touch );
+void numa_free ( void *block );
+void numa_report ( void );
+// On-node halos through MPI-3 shared memory (in sph_shm.c)
+void shm_init ( void );
+void shm_finalize ( void );
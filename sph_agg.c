@@ -0,0 +1,210 @@
+#include "sph.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+
+/* Aggregated checkpoint output (-A): instead of every rank writing its
+ * slice of the particles, groups of consecutive ranks gather them at
+ * their first rank, the aggregator, which writes the group's particles
+ * as one contiguous run. Writes are cut at multiples of the stripe size
+ * (-w), so that no write straddles two stripes of a striped file system
+ * and two aggregators only share the stripes at their boundary.
+ *
+ * Output goes to the shared checkpoint file NNNN.dat, each aggregator at
+ * its group's offset, or with -M to one subfile per aggregator,
+ * NNNN.dat.GGGG, listed in NNNN.idx as 'subfile first count' lines in idx
+ * order. The subfiles concatenated are the shared file.
+ */
+aggregate_t aggregate = {
+    .group = 0,
+    .subfiles = false,
+    .stripe = AGGREGATE_STRIPE_DEFAULT
+};
+
+static MPI_Comm group_comm = MPI_COMM_NULL;
+static MPI_Datatype particle_type;
+static int group_rank, group_size, group_index;
+static particle_t *buffer = NULL;   // The group's particles at aggregators
+static int_t buffer_cap = 0;
+
+
+void
+aggregate_init ( void )
+{
+    if ( aggregate.group == 0 )
+        return;
+
+    /* Groups are runs of consecutive ranks, their particles are runs of
+     * consecutive idx. One per node takes the runs of ranks on one node.
+     */
+    int color = rank / MAX ( 1, aggregate.group );
+    if ( aggregate.group == AGGREGATE_NODE )
+    {
+        MPI_Comm node_comm;
+        int node_first, firsts[size];
+        MPI_Comm_split_type ( comm, MPI_COMM_TYPE_SHARED, rank,
+            MPI_INFO_NULL, &node_comm
+        );
+        MPI_Allreduce ( &rank, &node_first, 1, MPI_INT, MPI_MIN, node_comm );
+        MPI_Comm_free ( &node_comm );
+        MPI_Allgather ( &node_first, 1, MPI_INT, firsts, 1, MPI_INT, comm );
+        for ( color = rank; color > 0 && firsts[color-1] == node_first; )
+            color -= 1;
+    }
+    MPI_Comm_split ( comm, color, rank, &group_comm );
+    MPI_Comm_rank ( group_comm, &group_rank );
+    MPI_Comm_size ( group_comm, &group_size );
+
+    /* Aggregators are numbered in rank order, which is idx order */
+    int is_aggregator = ( group_rank == 0 ), flags[size], aggregators = 0;
+    MPI_Allgather ( &is_aggregator, 1, MPI_INT, flags, 1, MPI_INT, comm );
+    for ( int r=0; r<size; r++ )
+    {
+        if ( r == rank )
+            group_index = aggregators;
+        aggregators += flags[r];
+    }
+
+    MPI_Type_contiguous ( sizeof(particle_t), MPI_BYTE, &particle_type );
+    MPI_Type_commit ( &particle_type );
+
+    if ( rank == 0 )
+        printf ( "Checkpoints by %d aggregators, %s, %ld byte stripes\n",
+            aggregators, aggregate.subfiles ? "subfiles" : "shared file",
+            aggregate.stripe
+        );
+}
+
+
+void
+aggregate_finalize ( void )
+{
+    if ( group_comm == MPI_COMM_NULL )
+        return;
+    MPI_Type_free ( &particle_type );
+    MPI_Comm_free ( &group_comm );
+    group_comm = MPI_COMM_NULL;
+    free ( buffer );
+    buffer = NULL, buffer_cap = 0;
+}
+
+
+/* Write 'bytes' at 'offset' of 'fd', cut at multiples of the stripe */
+static void
+write_stripes ( int fd, const char *data, int_t bytes, int_t offset,
+    const char *filename )
+{
+    while ( bytes > 0 )
+    {
+        int_t chunk = MIN ( bytes,
+            aggregate.stripe - offset % aggregate.stripe
+        );
+        ssize_t written = pwrite ( fd, data, chunk, offset );
+        if ( written <= 0 )
+        {
+            int error = ( written < 0 ) ? errno : EIO;
+            fprintf ( stderr, "Error: Rank %d cannot write '%s': %s, "
+                "aborting\n", rank, filename, strerror ( error )
+            );
+            MPI_Abort ( comm, error );
+        }
+        data += written, offset += written, bytes -= written;
+    }
+}
+
+
+/* Collective over the ranks of comm: 'n' particles, the slice of idx from
+ * 'first', go through the aggregators to 'filename' or its subfiles
+ */
+void
+aggregate_write ( char *filename, particle_t *particles, int_t n, int_t first )
+{
+    /* Counts and places in the group's run, in particles */
+    int count = n, counts[group_size], displacements[group_size];
+    MPI_Gather ( &count, 1, MPI_INT, counts, 1, MPI_INT, 0, group_comm );
+    int_t n_group = 0;
+    if ( group_rank == 0 )
+    {
+        for ( int r=0; r<group_size; r++ )
+        {
+            displacements[r] = n_group;
+            n_group += counts[r];
+        }
+        if ( n_group > buffer_cap )
+        {
+            free ( buffer );
+            buffer_cap = n_group;
+            buffer = malloc ( buffer_cap * sizeof(particle_t) );
+        }
+    }
+    MPI_Gatherv ( particles, count, particle_type,
+        buffer, counts, displacements, particle_type, 0, group_comm
+    );
+
+    if ( group_rank == 0 )
+    {
+        char name[strlen ( filename ) + 8];
+        int_t offset = first * sizeof(particle_t);
+        if ( aggregate.subfiles )
+        {
+            sprintf ( name, "%s.%.4d", filename, group_index );
+            offset = 0;
+        }
+        else
+            strcpy ( name, filename );
+        int fd = open ( name, O_WRONLY | O_CREAT
+            | ( aggregate.subfiles ? O_TRUNC : 0 ), 0644
+        );
+        if ( fd < 0 )
+        {
+            fprintf ( stderr, "Error: Rank %d cannot open '%s': %s, "
+                "aborting\n", rank, name, strerror ( errno )
+            );
+            MPI_Abort ( comm, errno );
+        }
+        write_stripes ( fd, (char *) buffer, n_group * sizeof(particle_t),
+            offset, name
+        );
+        /* The shared file is not truncated before the writes, drop what
+         * an older, longer file left behind
+         */
+        if ( !aggregate.subfiles && rank == 0
+            && ftruncate ( fd, n_global_field * sizeof(particle_t) ) != 0 )
+            fprintf ( stderr, "Warning: cannot truncate '%s'\n", name );
+        close ( fd );
+    }
+
+    /* The master lists the subfiles in the index. A shared file of an
+     * earlier run would shadow them on restart.
+     */
+    if ( aggregate.subfiles )
+    {
+        int_t part[2] = { group_rank == 0 ? first : -1, n_group },
+            parts[2*size];
+        MPI_Gather ( part, 2, INT_MACRO_MPI, parts, 2, INT_MACRO_MPI, 0, comm );
+        if ( rank == 0 )
+        {
+            char index[strlen ( filename ) + 8], base[strlen ( filename ) + 1];
+            aggregate_index_name ( index, filename );
+            strcpy ( base, filename );
+            char *subfile = basename ( base );
+            FILE *out = fopen ( index, "w" );
+            if ( out == NULL )
+            {
+                fprintf ( stderr, "Error: cannot write '%s', aborting\n",
+                    index
+                );
+                MPI_Abort ( comm, EIO );
+            }
+            fprintf ( out, "# subfile first count\n" );
+            unlink ( filename );
+            for ( int r=0, g=0; r<size; r++ )
+                if ( parts[2*r] >= 0 )
+                    fprintf ( out, "%s.%.4d %ld %ld\n",
+                        subfile, g++, parts[2*r], parts[2*r+1]
+                    );
+            fclose ( out );
+        }
+    }
+    MPI_Barrier ( comm );
+}
@@ -0,0 +1,85 @@
+#include "sph.h"
+
+/* In-situ diagnostics: a few scalars of the flow every diag_frequency
+ * steps, reduced over all ranks and written by the master as one line
+ *
+ *   step time front column kinetic potential p_wall
+ *
+ * to <output_dir>/diagnostics.txt. front is the largest x of any
+ * particle (surge front), column the highest particle within 2H of the
+ * left wall (residual water column), kinetic and potential the total
+ * energies (per unit depth), and p_wall the largest pressure within 2H
+ * of the right wall. Runs that only need these curves can turn
+ * snapshots off with '-c 0'.
+ */
+extern bool restart;
+extern real_t t_sim;
+extern particle_t *list;
+
+int_t diag_frequency = 0;   // Steps between samples, 0 disables (-d)
+static FILE *diag_file = NULL;
+
+
+void
+diag_init ( void )
+{
+    if ( diag_frequency <= 0 || rank != 0 )
+        return;
+    char filename[256];
+    sprintf ( filename, "%s/diagnostics.txt", output_dir );
+    /* Restarts continue the series of the run they restart */
+    diag_file = fopen ( filename, restart ? "a" : "w" );
+    if ( diag_file == NULL )
+    {
+        fprintf ( stderr, "Cannot write diagnostics to '%s'\n", filename );
+        MPI_Abort ( MPI_COMM_WORLD, EXIT_FAILURE );
+    }
+    if ( !restart )
+        fprintf ( diag_file,
+            "# step time front column kinetic potential p_wall\n"
+        );
+}
+
+
+/* Sample the field particles of the list, which holds their state at the
+ * end of the step until the next one marshals them again
+ */
+void
+diag_sample ( int_t step )
+{
+    real_t front = -INFINITY, column = 0.0, p_wall = 0.0,
+        kinetic = 0.0, potential = 0.0;
+
+    #pragma omp parallel for reduction(max:front,column,p_wall) \
+        reduction(+:kinetic,potential)
+    for ( int_t k=0; k<n_field; k++ )
+    {
+        front = MAX ( front, X(k) );
+        if ( X(k) < 2*H )
+            column = MAX ( column, Y(k) );
+        if ( X(k) > B-2*H )
+            p_wall = MAX ( p_wall, P(k) );
+        kinetic += 0.5 * M(k) * ( VX(k)*VX(k) + VY(k)*VY(k) );
+        potential += M(k) * 9.81 * Y(k);
+    }
+
+    real_t local_max[3] = { front, column, p_wall }, global_max[3],
+        local_sum[2] = { kinetic, potential }, global_sum[2];
+    MPI_Reduce ( local_max, global_max, 3, REAL_MACRO_MPI, MPI_MAX, 0, comm );
+    MPI_Reduce ( local_sum, global_sum, 2, REAL_MACRO_MPI, MPI_SUM, 0, comm );
+
+    if ( rank == 0 )
+        fprintf ( diag_file, "%ld %.6e %.6e %.6e %.6e %.6e %.6e\n",
+            step, t_sim, global_max[0], global_max[1],
+            global_sum[0], global_sum[1], global_max[2]
+        );
+}
+
+
+void
+diag_finalize ( void )
+{
+    if ( diag_file != NULL )
+        fclose ( diag_file );
+    diag_file = NULL;
+}
@@ -9,7 +9,8 @@ extern int_t n_field, n_global_field;
 extern int_t n_capacity, n_pair_cap;
 extern particle_t *list;
 extern pair_t *pairs;
-extern real_t subdomain[2];
+extern real_t subdomain[2], t_sim;
+extern raster_t frame;
 
 void
 collect_checkpoint ( void )
@@ -53,7 +54,7 @@ collect_checkpoint ( void )
         {
             MPI_Ssend ( p, sizeof(particle_t), MPI_BYTE,
                 target, pi-offsets[target],
-                MPI_COMM_WORLD
+                comm
             );
         }
         else if ( p == NULL && target == rank ) // Recv from anywhere
@@ -61,12 +62,12 @@ collect_checkpoint ( void )
             MPI_Recv ( &checkpoint[pi-offsets[rank]],
                 sizeof(particle_t), MPI_BYTE,
                 MPI_ANY_SOURCE, pi-offsets[rank],
-                MPI_COMM_WORLD, MPI_STATUS_IGNORE
+                comm, MPI_STATUS_IGNORE
             );
         }
         /* Rank offset-relative particle position as tag uniquely identifes
          * receive operations, barrier no longer necessary
-         * MPI_Barrier ( MPI_COMM_WORLD );
+         * MPI_Barrier ( comm );
          */
     }
 }
@@ -74,9 +75,47 @@ collect_checkpoint ( void )
 
 
 
-/* NB allocation - this routine builds particle pointer lists
- *  on stack, go to dynamic allocation if it overflows
+/* The records of the local particles in the view, 'n_values' real_t
+ * each, in a buffer the caller frees
  */
+static real_t *
+select_view ( int_t *n_records, int *n_values )
+{
+    int_t my_particles = n_particles();
+    particle_t **actual_ptr = malloc ( my_particles * sizeof(particle_t *) );
+    list_particles ( actual_ptr );
+
+    int fields = view.fields;
+    *n_values = ( (fields & VIEW_IDX) ? 1 : 0 ) + ( (fields & VIEW_X) ? 2 : 0 )
+        + ( (fields & VIEW_V) ? 2 : 0 ) + ( (fields & VIEW_RHO) ? 1 : 0 )
+        + ( (fields & VIEW_P) ? 1 : 0 );
+    real_t *data = malloc ( my_particles * *n_values * sizeof(real_t) ),
+        *at = data;
+
+    for ( int_t mp=0; mp<my_particles; mp++ )
+    {
+        particle_t *p = actual_ptr[mp];
+        if ( p->idx % view.stride != 0
+            || p->x[0] < view.box[0] || p->x[1] < view.box[1]
+            || p->x[0] > view.box[2] || p->x[1] > view.box[3] )
+            continue;
+        if ( fields & VIEW_IDX )
+            *at++ = (real_t)p->idx;
+        if ( fields & VIEW_X )
+            *at++ = p->x[0], *at++ = p->x[1];
+        if ( fields & VIEW_V )
+            *at++ = p->v[0], *at++ = p->v[1];
+        if ( fields & VIEW_RHO )
+            *at++ = p->rho;
+        if ( fields & VIEW_P )
+            *at++ = p->p;
+    }
+    free ( actual_ptr );
+    *n_records = ( *n_values > 0 ) ? (at - data) / *n_values : 0;
+    return data;
+}
+
+
 #ifndef WITH_MPIIO
 // Stupid POSIX-I/O, synchronizing iterations w. append to file
 // Unsure how this interacts with parallel FS, but it avoids
@@ -84,46 +123,42 @@ collect_checkpoint ( void )
 void
 dump_state ( char *filename )
 {
-    int_t my_particles = n_particles();
-    real_t data[my_particles][3];
-    particle_t *actual_ptr[my_particles];
-    list_particles ( &(actual_ptr[0]) );
+    int_t my_particles;
+    int n_values;
+    real_t *data = select_view ( &my_particles, &n_values );
 
-    for ( int_t mp=0; mp<my_particles; mp++ )
-    {
-        particle_t *p = actual_ptr[mp];
-        data[mp][0] = (real_t)p->idx;
-        data[mp][1] = p->x[0];
-        data[mp][2] = p->x[1];
-    }
-    /* Token ring synchronization for I/O */
+    /* Token ring synchronization for I/O, the first rank truncates */
     int token = rank, discard;
     FILE *out;
     switch ( rank )
     {
         case 0:
-            out = fopen ( filename, "a" );
-            fwrite ( data, 3*sizeof(real_t), my_particles, out );
+            out = fopen ( filename, "w" );
+            fwrite ( data, n_values*sizeof(real_t), my_particles, out );
             fclose ( out );
-            MPI_Ssend ( &token, 1, MPI_INT, east, 0, MPI_COMM_WORLD );
-            MPI_Recv ( &discard, 1, MPI_INT, west, 0,
-                MPI_COMM_WORLD, MPI_STATUS_IGNORE
-            );
+            if ( size > 1 )     // Alone, the token would come to itself
+            {
+                MPI_Ssend ( &token, 1, MPI_INT, east, 0, comm );
+                MPI_Recv ( &discard, 1, MPI_INT, west, 0,
+                    comm, MPI_STATUS_IGNORE
+                );
+            }
             break;
         default:
             MPI_Recv ( &discard, 1, MPI_INT, west, 0,
-                MPI_COMM_WORLD, MPI_STATUS_IGNORE
+                comm, MPI_STATUS_IGNORE
             );
             out = fopen ( filename, "a" );
-            fwrite ( data, 3*sizeof(real_t), my_particles, out );
+            fwrite ( data, n_values*sizeof(real_t), my_particles, out );
             fclose ( out );
-            MPI_Ssend ( &token, 1, MPI_INT, east, 0, MPI_COMM_WORLD );
+            MPI_Ssend ( &token, 1, MPI_INT, east, 0, comm );
             break;
     }
+    free ( data );
     /* This barrier is probably not necessary,
      * border exchange also forces sync.
      */
-    MPI_Barrier ( MPI_COMM_WORLD );
+    TIMING_BARRIER ();
 }
 
 
@@ -140,6 +175,12 @@ write_checkpoint ( char *filename )
         offsets[r] = offsets[r-1] +
             (n_global_field / size) + (((r-1)<(n_global_field % size))?1:0);
     }
+
+    if ( aggregate.group != 0 )
+    {
+        aggregate_write ( filename, checkpoint, n_local_cp, offsets[rank] );
+        return;
+    }
 //////////////////////////////////
     int token = rank, discard;
     FILE *out;
@@ -149,25 +190,28 @@ write_checkpoint ( char *filename )
             out = fopen ( filename, "a" );
             fwrite ( checkpoint, sizeof(particle_t), n_local_cp, out );
             fclose ( out );
-            MPI_Ssend ( &token, 1, MPI_INT, east, 0, MPI_COMM_WORLD );
-            MPI_Recv ( &discard, 1, MPI_INT, west, 0,
-                MPI_COMM_WORLD, MPI_STATUS_IGNORE
-            );
+            if ( size > 1 )     // Alone, the token would come to itself
+            {
+                MPI_Ssend ( &token, 1, MPI_INT, east, 0, comm );
+                MPI_Recv ( &discard, 1, MPI_INT, west, 0,
+                    comm, MPI_STATUS_IGNORE
+                );
+            }
             break;
         default:
             MPI_Recv ( &discard, 1, MPI_INT, west, 0,
-                MPI_COMM_WORLD, MPI_STATUS_IGNORE
+                comm, MPI_STATUS_IGNORE
             );
             out = fopen ( filename, "a" );
             fwrite ( checkpoint, sizeof(particle_t), n_local_cp, out );
             fclose ( out );
-            MPI_Ssend ( &token, 1, MPI_INT, east, 0, MPI_COMM_WORLD );
+            MPI_Ssend ( &token, 1, MPI_INT, east, 0, comm );
             break;
     }
     /* This barrier is probably not necessary,
      * border exchange also forces sync.
      */
-    MPI_Barrier ( MPI_COMM_WORLD );
+    MPI_Barrier ( comm );
 /*
 //////////////////////////////////
     MPI_Info info;
@@ -175,7 +219,7 @@ write_checkpoint ( char *filename )
     MPI_Info_set ( info, "access_style", "write_once" );
     MPI_File out;
     MPI_File_open (
-        MPI_COMM_WORLD, filename, MPI_MODE_CREATE|MPI_MODE_WRONLY,
+        comm, filename, MPI_MODE_CREATE|MPI_MODE_WRONLY,
         info, &out
     );
     MPI_Offset my_offset = offsets[rank];
@@ -184,7 +228,7 @@ write_checkpoint ( char *filename )
         MPI_STATUS_IGNORE
     );
     MPI_File_close ( &out );
-    MPI_Barrier ( MPI_COMM_WORLD );
+    TIMING_BARRIER ();
 */
 }
 #else
@@ -203,13 +247,19 @@ write_checkpoint ( char *filename )
             (n_global_field / size) + (((r-1)<(n_global_field % size))?1:0);
     }
 
+    if ( aggregate.group != 0 )
+    {
+        aggregate_write ( filename, checkpoint, n_local_cp, offsets[rank] );
+        return;
+    }
+
     MPI_Info info;
     MPI_Info_create ( &info );
     MPI_Info_set ( info, "access_style", "write_once" );
 //   MPI_Info_set ( info, "striping_factor", "4" );
     MPI_File out;
     MPI_File_open (
-        MPI_COMM_WORLD, filename, MPI_MODE_CREATE|MPI_MODE_WRONLY,
+        comm, filename, MPI_MODE_CREATE|MPI_MODE_WRONLY,
         info, &out
     );
     MPI_Offset my_offset = offsets[rank];
@@ -224,45 +274,63 @@ write_checkpoint ( char *filename )
     );
     */
     MPI_File_close ( &out );
-    MPI_Barrier ( MPI_COMM_WORLD );
+    TIMING_BARRIER ();
 }
 
 
 void
 dump_state ( char *filename )
 {
-    MPI_Barrier ( MPI_COMM_WORLD );
-    int_t my_particles = n_particles();
-
-    real_t data[my_particles][3];
-    particle_t *actual_ptr[my_particles];
-    list_particles ( &(actual_ptr[0]) );
-
-    for ( int_t mp=0; mp<my_particles; mp++ )
-    {
-        particle_t *p = actual_ptr[mp];
-        data[mp][0] = (real_t)p->idx;
-        data[mp][1] = p->x[0];
-        data[mp][2] = p->x[1];
-    }
+    TIMING_BARRIER ();
+    int_t my_particles;
+    int n_values;
+    real_t *data = select_view ( &my_particles, &n_values );
 
     MPI_Info info;
     MPI_Info_create ( &info );
     MPI_Info_set ( info, "access_style", "write_once" );
     MPI_File out;
     MPI_File_open (
-        MPI_COMM_WORLD, filename, MPI_MODE_CREATE|MPI_MODE_WRONLY,
+        comm, filename, MPI_MODE_CREATE|MPI_MODE_WRONLY,
         info, &out
     );
+    MPI_File_set_size ( out, 0 );
     MPI_File_write_ordered (
-        out, data, 3*my_particles*sizeof(real_t), MPI_BYTE, MPI_STATUS_IGNORE
+        out, data, n_values*my_particles*sizeof(real_t), MPI_BYTE,
+        MPI_STATUS_IGNORE
     );
     MPI_File_close ( &out );
-    MPI_Barrier ( MPI_COMM_WORLD );
+    free ( data );
+    TIMING_BARRIER ();
 }
 #endif
 
 
+/* Frame of the field particles at an output step: every rank draws its
+ * own, the master writes the max over all of them
+ */
+void
+write_frame ( char *filename )
+{
+    int_t n_pixels = (int_t) frame.width * frame.height;
+    float *grid = malloc ( n_pixels * sizeof(float) ), *all = NULL;
+    raster_splat ( &frame, list, n_field, grid );
+    if ( rank == 0 )
+        all = malloc ( n_pixels * sizeof(float) );
+    MPI_Reduce ( grid, all, n_pixels, MPI_FLOAT, MPI_MAX, 0, comm );
+    if ( rank == 0 )
+    {
+        int status = raster_write ( &frame, all, filename );
+        if ( status != 0 )
+            fprintf ( stderr, "Cannot write frame '%s': %s\n",
+                filename, strerror ( status )
+            );
+        free ( all );
+    }
+    free ( grid );
+}
+
+
 void
 restart_checkpoint ( int_t iteration )
 {
@@ -272,11 +340,12 @@ restart_checkpoint ( int_t iteration )
      * Skip the iteration represented by the loaded checkpoint
      */
     min_iteration = file_number * checkpoint_frequency + 1;
+    t_sim = file_number * checkpoint_frequency * problem.dt;
 
     /* Generate the assumed checkpoint file name */
     char filename[256];
     memset ( filename, 0, 256*sizeof(char) );
-    sprintf ( filename, "plot/%.4ld.dat", file_number );
+    sprintf ( filename, "%s/%.4ld.dat", output_dir, file_number );
     printf (
         "Rank %d resumes from '%s', iteration %ld, freq. %ld, maxiter %ld\n",
         rank, filename, min_iteration, checkpoint_frequency, max_iteration
@@ -290,9 +359,9 @@ restart_checkpoint ( int_t iteration )
                 "Error: (min,max) iterations set to %ld, %ld, aborting.\n",
                 min_iteration, max_iteration
             );
-        MPI_Barrier ( MPI_COMM_WORLD );
+        MPI_Barrier ( comm );
         /* Stop with errno error code for 'invalid argument' */
-        MPI_Abort ( MPI_COMM_WORLD, EINVAL );
+        MPI_Abort ( comm, EINVAL );
     }
 
     /* The following setup is identical to that of initialize(): */
@@ -315,47 +384,260 @@ restart_checkpoint ( int_t iteration )
      * read the particle states from file instead
      */
     
-    /* Read-only parallel open should not thrash parallel FS */
-    FILE *checkpoint = fopen ( filename, "r" );
+    /* The checkpoint file, or with -M the subfiles in its index. Read-only
+     * parallel open should not thrash parallel FS
+     */
+    char (*parts)[256];
+    int n_parts = aggregate_parts ( filename, &parts );
 
     /* Fail if the checkpoint file doesn't exist */
-    if ( checkpoint == NULL )
+    if ( n_parts == 0 )
     {
         fprintf ( stderr,
             "Error: Rank %d unable to open '%s', aborting\n", rank, filename
         );
         /* Stop with errno code for 'No such file or directory' */
-        MPI_Abort ( MPI_COMM_WORLD, ENOENT );
+        MPI_Abort ( comm, ENOENT );
     }
 
-    /* Scan all the particles in the file, copy those within my subdomain */
-    particle_t p;
-    int items = fread ( &p, sizeof(particle_t), 1, checkpoint );
-    n_global_field = items;
-    while ( items != 0 )
+    /* Checkpoints are the particles as they are in memory, so their layout
+     * follows the build (BUCKET/BLOCK_STEP/MIXED_PRECISION). Read with
+     * another layout, the sizes or the indices don't add up.
+     */
+    FILE *checkpoint;
+    long checkpoint_bytes = 0;
+    bool whole_particles = true;
+    for ( int f=0; f<n_parts; f++ )
     {
-        /* This requires a hack so as not to drop particles temporarily
-         * outside the domain (due to numerical inaccuracy)
-         */
-        if (
-            (p.x[0] >= subdomain[0] && p.x[0] < subdomain[1])
-         || (p.x[0] < 0.0 && rank == 0 )
-         || (p.x[0] > B && rank == size-1)
-        )
+        checkpoint = fopen ( parts[f], "r" );
+        if ( checkpoint == NULL )
         {
-            particle_t *keep_local = malloc ( sizeof(particle_t) );
-            memcpy ( keep_local, &p, sizeof(particle_t) );
-            insert_particle ( keep_local );
+            fprintf ( stderr, "Error: Rank %d unable to open '%s', "
+                "aborting\n", rank, parts[f]
+            );
+            MPI_Abort ( comm, ENOENT );
         }
-        items = fread ( &p, sizeof(particle_t), 1, checkpoint );
+        fseek ( checkpoint, 0, SEEK_END );
+        long part_bytes = ftell ( checkpoint );
+        fclose ( checkpoint );
+        whole_particles &= ( part_bytes % sizeof(particle_t) == 0 );
+        checkpoint_bytes += part_bytes;
+    }
+    int_t n_stored = checkpoint_bytes / sizeof(particle_t);
+
+    /* Scan all the particles in the files, copy those within my subdomain */
+    n_global_field = 0;
+    for ( int f=0; f<n_parts; f++ )
+    {
+        checkpoint = fopen ( parts[f], "r" );
+        particle_t p;
+        int items = fread ( &p, sizeof(particle_t), 1, checkpoint );
         n_global_field += items;
-    } 
-    fclose ( checkpoint );
+        while ( items != 0 )
+        {
+            if ( !whole_particles || p.idx < 0 || p.idx >= n_stored )
+            {
+                fprintf ( stderr, "Error: Rank %d, '%s' was written by a "
+                    "solver built with other flags, aborting\n",
+                    rank, parts[f]
+                );
+                MPI_Abort ( comm, EINVAL );
+            }
+            /* This requires a hack so as not to drop particles temporarily
+             * outside the domain (due to numerical inaccuracy)
+             */
+            if (
+                (p.x[0] >= subdomain[0] && p.x[0] < subdomain[1])
+             || (p.x[0] < 0.0 && rank == 0 )
+             || (p.x[0] > B && rank == size-1)
+            )
+            {
+                particle_t *keep_local = malloc ( sizeof(particle_t) );
+                memcpy ( keep_local, &p, sizeof(particle_t) );
+                insert_particle ( keep_local );
+            }
+            items = fread ( &p, sizeof(particle_t), 1, checkpoint );
+            n_global_field += items;
+        }
+        fclose ( checkpoint );
+    }
+    free ( parts );
 
     /* Returning to mimic initialize() */
     n_field = n_particles();
 
     /* Start-allocation for list of local particles and pairs */
-    list = (particle_t *) malloc ( n_capacity * sizeof(particle_t) );
-    pairs = malloc ( n_pair_cap * sizeof(pair_t) );
+    list = numa_alloc ( n_capacity * sizeof(particle_t) );
+    pairs = numa_alloc ( n_pair_cap * sizeof(pair_t) );
+}
+
+
+/* Snapshots hold the working set of one rank at one step: the list with
+ * ghosts and mirrors, and the pairs with kernel values. They are read
+ * back by the replay mode of the benchmarks to rerun single phases.
+ */
+#define SNAPSHOT_MAGIC "SPHSNAP2"
+
+#ifdef BUCKET
+#define SNAPSHOT_BUCKET 1
+#else
+#define SNAPSHOT_BUCKET 0
+#endif //BUCKET
+#ifdef BLOCK_STEP
+#define SNAPSHOT_BLOCK_STEP 2
+#else
+#define SNAPSHOT_BLOCK_STEP 0
+#endif //BLOCK_STEP
+#ifdef CSR_PAIRS
+#define SNAPSHOT_CSR_PAIRS 4
+#else
+#define SNAPSHOT_CSR_PAIRS 0
+#endif //CSR_PAIRS
+#ifdef MIXED_PRECISION
+#define SNAPSHOT_MIXED_PRECISION 8
+#else
+#define SNAPSHOT_MIXED_PRECISION 0
+#endif //MIXED_PRECISION
+#define SNAPSHOT_FLAGS (SNAPSHOT_BUCKET | SNAPSHOT_BLOCK_STEP \
+    | SNAPSHOT_CSR_PAIRS | SNAPSHOT_MIXED_PRECISION)
+
+typedef struct {
+    char magic[8];
+    int32_t
+        particle_size,  // Layouts must match between writer and reader
+        pair_size,
+        flags,
+        rank, size;
+    int_t step, n_field, n_virt, n_mirror, n_halo, n_pairs;
+    problem_t problem;
+    real_t dt, subdomain[2], halo_width, halo_reach;
+    uint64_t list_base;     // Where the list was, to rebase pair pointers
+} snapshot_t;
+
+extern int_t n_virt, n_mirror, n_halo, n_pairs;
+extern real_t halo_width, halo_reach;
+#ifdef BLOCK_STEP
+extern bool *active;
+extern int_t n_active_cap;
+#endif //BLOCK_STEP
+
+
+void
+dump_snapshot ( int_t step )
+{
+    char filename[256];
+    sprintf ( filename, "%s/snapshot_%.6ld_%.4d.bin", output_dir, step, rank );
+    snapshot_t head = {
+        .magic = SNAPSHOT_MAGIC,
+        .particle_size = sizeof(particle_t), .pair_size = sizeof(pair_t),
+        .flags = SNAPSHOT_FLAGS, .rank = rank, .size = size,
+        .step = step, .n_field = n_field, .n_virt = n_virt,
+        .n_mirror = n_mirror, .n_halo = n_halo, .n_pairs = n_pairs,
+        .problem = problem, .dt = dt,
+        .subdomain = { subdomain[0], subdomain[1] },
+        .halo_width = halo_width, .halo_reach = halo_reach,
+        .list_base = (uint64_t)(uintptr_t)list
+    };
+    int_t n_list = n_field + n_virt + n_mirror;
+
+    FILE *out = fopen ( filename, "w" );
+    if ( out == NULL )
+    {
+        fprintf ( stderr, "Error: Rank %d unable to write '%s', aborting\n",
+            rank, filename
+        );
+        MPI_Abort ( comm, EIO );
+    }
+    fwrite ( &head, sizeof(snapshot_t), 1, out );
+    fwrite ( list, sizeof(particle_t), n_list, out );
+    fwrite ( pairs, sizeof(pair_t), n_pairs, out );
+#ifdef BLOCK_STEP
+    fwrite ( active, sizeof(bool), n_list, out );
+#endif //BLOCK_STEP
+    fclose ( out );
+    if ( rank == 0 )
+        printf ( "Snapshot at step %ld, '%s'\n", step, filename );
+}
+
+
+/* Restore a rank's working set from a snapshot, returns its step */
+int_t
+load_snapshot ( char *filename )
+{
+    snapshot_t head;
+    FILE *in = fopen ( filename, "r" );
+    if ( in == NULL || fread ( &head, sizeof(snapshot_t), 1, in ) != 1 )
+    {
+        fprintf ( stderr, "Error: unable to read '%s', aborting\n", filename );
+        MPI_Abort ( comm, ENOENT );
+    }
+    if ( memcmp ( head.magic, SNAPSHOT_MAGIC, 8 ) != 0
+        || head.particle_size != sizeof(particle_t)
+        || head.pair_size != sizeof(pair_t) || head.flags != SNAPSHOT_FLAGS )
+    {
+        fprintf ( stderr, "Error: '%s' was written by a solver built with "
+            "other flags (BUCKET/BLOCK_STEP/CSR_PAIRS/MIXED_PRECISION), "
+            "aborting\n", filename
+        );
+        MPI_Abort ( comm, EINVAL );
+    }
+
+    problem = head.problem;
+    dt = head.dt;
+    subdomain[0] = head.subdomain[0], subdomain[1] = head.subdomain[1];
+    halo_width = head.halo_width, halo_reach = head.halo_reach;
+    n_field = head.n_field, n_virt = head.n_virt, n_mirror = head.n_mirror;
+    n_halo = head.n_halo, n_pairs = head.n_pairs;
+
+    /* Replays start without initialize(), which allocates the arrays */
+    int_t n_list = n_field + n_virt + n_mirror;
+    if ( list == NULL )
+        list = numa_alloc ( n_capacity * sizeof(particle_t) );
+    if ( pairs == NULL )
+        pairs = numa_alloc ( n_pair_cap * sizeof(pair_t) );
+    resize_list ( n_list );
+    if ( n_pair_cap < n_pairs )
+        resize_pair_list ( n_pairs );
+    bool complete =
+        fread ( list, sizeof(particle_t), n_list, in ) == (size_t)n_list
+        && fread ( pairs, sizeof(pair_t), n_pairs, in ) == (size_t)n_pairs;
+#ifdef BLOCK_STEP
+    if ( n_active_cap < n_list )
+    {
+        n_active_cap = n_list;
+        active = realloc ( active, n_active_cap * sizeof(bool) );
+    }
+    complete = complete
+        && fread ( active, sizeof(bool), n_list, in ) == (size_t)n_list;
+#endif //BLOCK_STEP
+    fclose ( in );
+    if ( !complete )
+    {
+        fprintf ( stderr, "Error: '%s' is truncated, aborting\n", filename );
+        MPI_Abort ( comm, EIO );
+    }
+
+    /* The field particles go back into a table, as after restart */
+    particles_init();
+    for ( int_t k=0; k<n_field; k++ )
+    {
+        particle_t *keep_local = malloc ( sizeof(particle_t) );
+        memcpy ( keep_local, &(list[k]), sizeof(particle_t) );
+        insert_particle ( keep_local );
+    }
+
+#ifdef CSR_PAIRS
+    /* Rows only depend on the pairs, the kernel refills their values */
+    build_neighbor_lists ();
+#elif defined(BUCKET)
+    /* Pairs point into the list they were found in */
+    for ( int_t kk=0; kk<n_pairs; kk++ )
+    {
+        pairs[kk].ip = list + (((uintptr_t)pairs[kk].ip - head.list_base)
+            / sizeof(particle_t));
+        pairs[kk].jp = list + (((uintptr_t)pairs[kk].jp - head.list_base)
+            / sizeof(particle_t));
+    }
+#endif //BUCKET
+    return head.step;
 }
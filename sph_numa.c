@@ -0,0 +1,198 @@
+#define _GNU_SOURCE     // sched_getcpu(), sched_getaffinity(), MAP_ANONYMOUS
+#include "sph.h"
+#include <sched.h>
+#include <sys/mman.h>
+
+/* The large arrays (list, pairs) are placed by first touch: a page lands
+ * on the NUMA node of the thread that first writes it. Fresh memory is
+ * mapped here and touched by all threads in static blocks, the split of
+ * the solver's 'omp for' loops, so that threads mostly work on pages of
+ * their own node. With -DWITH_THP mappings are aligned to 2 MB and
+ * advised to use transparent huge pages.
+ */
+#ifdef WITH_THP
+#define NUMA_ALIGN ((size_t)2 << 20)
+#else
+#define NUMA_ALIGN ((size_t)4096)
+#endif
+#define NUMA_PAGE ((size_t)4096)
+
+/* In front of every block, keeps the block cache line aligned */
+typedef struct {
+    void *base;
+    size_t length;
+    char pad[64 - sizeof(void *) - sizeof(size_t)];
+} numa_header_t;
+
+
+/* Thread t's part of 'bytes', on page bounds */
+static void
+numa_part ( size_t bytes, int t, int n, size_t *begin, size_t *end )
+{
+    size_t pages = (bytes + NUMA_PAGE - 1) / NUMA_PAGE;
+    *begin = MIN ( bytes, (pages * t / n) * NUMA_PAGE );
+    *end = MIN ( bytes, (pages * (t+1) / n) * NUMA_PAGE );
+}
+
+
+/* Grow 'old' (NULL for none) to 'new_bytes', keeping its first 'old_bytes'.
+ * Outside of parallel regions the copy, and with 'touch' the first touch
+ * of the rest, run on all threads. Inside one the caller copies. Pages
+ * left untouched go to their first writers, and cost nothing until then,
+ * which suits capacities reserved far beyond use. A block that already
+ * holds 'new_bytes' is returned as it is. NULL if there is no memory.
+ */
+void *
+numa_realloc ( void *old, size_t old_bytes, size_t new_bytes, bool touch )
+{
+    /* Callers ask again for the capacity they have, the mapping is
+     * rounded up to pages and may hold more
+     */
+    if ( old != NULL )
+    {
+        numa_header_t *old_header = (numa_header_t *)old - 1;
+        if ( (char *)old + new_bytes
+            <= (char *)old_header->base + old_header->length )
+            return old;
+    }
+
+    size_t length = new_bytes + sizeof(numa_header_t) + NUMA_ALIGN;
+    char *base = mmap ( NULL, length, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0
+    );
+    if ( base == MAP_FAILED )
+        return NULL;
+
+    /* The block starts a page (huge page) after the header */
+    char *block = (char *)
+        ( ((uintptr_t)base + sizeof(numa_header_t) + NUMA_ALIGN - 1)
+        & ~(uintptr_t)(NUMA_ALIGN - 1) );
+    numa_header_t *header = (numa_header_t *)block - 1;
+    header->base = base;
+    header->length = length;
+#ifdef WITH_THP
+    madvise ( block, new_bytes, MADV_HUGEPAGE );
+#endif //WITH_THP
+
+    old_bytes = (old == NULL) ? 0 : MIN ( old_bytes, new_bytes );
+    if ( omp_in_parallel () )
+        memcpy ( block, old, old_bytes );
+    else
+    {
+        #pragma omp parallel
+        {
+            size_t begin, end;
+            numa_part ( new_bytes, omp_get_thread_num(), omp_get_num_threads(),
+                &begin, &end
+            );
+            if ( begin < old_bytes )
+                memcpy ( block + begin, (char *) old + begin,
+                    MIN ( end, old_bytes ) - begin
+                );
+            if ( touch )
+                for ( size_t b = MAX ( begin, old_bytes ); b < end;
+                    b += NUMA_PAGE )
+                    block[b] = 0;
+        }
+    }
+    numa_free ( old );
+    return block;
+}
+
+
+void *
+numa_alloc ( size_t bytes )
+{
+    return numa_realloc ( NULL, 0, bytes, true );
+}
+
+
+void
+numa_free ( void *block )
+{
+    if ( block == NULL )
+        return;
+    numa_header_t *header = (numa_header_t *)block - 1;
+    munmap ( header->base, header->length );
+}
+
+
+#ifdef __linux__
+/* CPUs in a mask as ranges, '0-3,8-11' */
+static void
+cpu_ranges ( cpu_set_t *mask, char *text, size_t length )
+{
+    size_t used = 0;
+    text[0] = '\0';
+    for ( int c = 0; c < CPU_SETSIZE && used < length; c++ )
+    {
+        if ( !CPU_ISSET ( c, mask ) )
+            continue;
+        int last = c;
+        while ( last+1 < CPU_SETSIZE && CPU_ISSET ( last+1, mask ) )
+            last++;
+        used += snprintf ( text + used, length - used,
+            (last > c) ? "%s%d-%d" : "%s%d", (used > 0) ? "," : "", c, last
+        );
+        c = last;
+    }
+}
+#endif //__linux__
+
+
+#define REPORT_LINE 128
+
+/* Where the threads of all ranks run, printed by the master at startup:
+ * the CPU each thread is on and the CPUs it may run on. Ranks send one
+ * fixed size line per thread.
+ */
+void
+numa_report ( void )
+{
+    static const char *binds[] = { "false", "true", "master", "close", "spread" };
+    int n_threads = omp_get_max_threads(), max_threads;
+    MPI_Allreduce ( &n_threads, &max_threads, 1, MPI_INT, MPI_MAX, comm );
+
+    int length = (max_threads + 1) * REPORT_LINE;
+    char *text = calloc ( length, 1 ), *all = NULL, host[64];
+    if ( rank == 0 )
+        all = malloc ( (size_t) length * size );
+
+    gethostname ( host, sizeof(host) );
+    host[sizeof(host)-1] = '\0';
+    omp_proc_bind_t bind = omp_get_proc_bind();
+    snprintf ( text, REPORT_LINE, "Rank %d on %s, %d threads, proc_bind %s",
+        rank, host, n_threads,
+        ( bind >= 0 && bind <= omp_proc_bind_spread ) ? binds[bind] : "?"
+    );
+
+    #pragma omp parallel
+    {
+        int t = omp_get_thread_num(), cpu = -1;
+        char cpus[REPORT_LINE] = "?";
+#ifdef __linux__
+        cpu_set_t mask;
+        CPU_ZERO ( &mask );
+        cpu = sched_getcpu();
+        if ( sched_getaffinity ( 0, sizeof(mask), &mask ) == 0 )
+            cpu_ranges ( &mask, cpus, sizeof(cpus) );
+#endif //__linux__
+        snprintf ( text + (t+1) * REPORT_LINE, REPORT_LINE,
+            "  thread %d on cpu %d of %s", t, cpu, cpus
+        );
+    }
+
+    MPI_Gather ( text, length, MPI_CHAR, all, length, MPI_CHAR, 0, comm );
+    if ( rank == 0 )
+    {
+        for ( int r = 0; r < size; r++ )
+            for ( int l = 0; l <= max_threads; l++ )
+            {
+                char *line = all + (size_t) r * length + l * REPORT_LINE;
+                if ( line[0] != '\0' )
+                    printf ( "%s\n", line );
+            }
+        free ( all );
+    }
+    free ( text );
+}
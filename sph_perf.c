@@ -0,0 +1,160 @@
+#define _GNU_SOURCE     // syscall()
+#include "sph.h"
+
+#ifdef WITH_PERF
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+
+/* Hardware counters per phase: every OpenMP thread opens its own
+ * counters, which only count that thread. Phases read them on all
+ * threads at their beginning and end, the differences add up per thread
+ * and are summed per rank in the report.
+ */
+static const struct { const char *name; uint64_t config; } events[] = {
+    { "cycles", PERF_COUNT_HW_CPU_CYCLES },
+    { "instructions", PERF_COUNT_HW_INSTRUCTIONS },
+    { "LLC-misses", PERF_COUNT_HW_CACHE_MISSES },
+    { "branch-misses", PERF_COUNT_HW_BRANCH_MISSES }
+};
+
+static const char *phase_names[PERF_PHASES] = {
+    "Generate ghosts",
+    "Border exchange",
+    "Time step",
+    "Particle migration",
+    "Input/output",
+    "Find neighbors"
+};
+
+static int n_threads = 0;
+static int (*fd)[PERF_EVENTS];          // [thread][event], -1 if missing
+static double
+    (*begin)[PERF_PHASES][PERF_EVENTS], // [thread][phase][event]
+    (*total)[PERF_PHASES][PERF_EVENTS];
+
+
+/* Counter value, scaled up if the kernel had to multiplex it */
+static double
+read_counter ( int counter )
+{
+    uint64_t value[3];  // Count, time enabled, time running
+    if ( counter < 0 || read ( counter, value, sizeof(value) ) != sizeof(value) )
+        return 0.0;
+    if ( value[2] == 0 )
+        return 0.0;
+    return (double)value[0] * ( (double)value[1] / (double)value[2] );
+}
+
+
+void
+perf_init ( void )
+{
+    n_threads = omp_get_max_threads();
+    fd = malloc ( n_threads * sizeof(*fd) );
+    begin = calloc ( n_threads, sizeof(*begin) );
+    total = calloc ( n_threads, sizeof(*total) );
+
+    int error[PERF_EVENTS] = { 0 };
+    #pragma omp parallel
+    {
+        int t = omp_get_thread_num();
+        for ( int e=0; e<PERF_EVENTS; e++ )
+        {
+            struct perf_event_attr attr;
+            memset ( &attr, 0, sizeof(attr) );
+            attr.size = sizeof(attr);
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = events[e].config;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED
+                | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            // This thread, any CPU, no group so missing events stand alone
+            fd[t][e] = syscall ( SYS_perf_event_open, &attr, 0, -1, -1, 0 );
+            if ( fd[t][e] < 0 )
+                error[e] = errno;
+        }
+    }
+
+    if ( rank == 0 )
+        for ( int e=0; e<PERF_EVENTS; e++ )
+            if ( error[e] != 0 )
+                fprintf ( stderr, "Warning: counter '%s' is not available "
+                    "(%s), check /proc/sys/kernel/perf_event_paranoid and "
+                    "that the machine exposes a PMU\n",
+                    events[e].name, strerror ( error[e] )
+                );
+}
+
+
+void
+perf_begin ( int phase )
+{
+    #pragma omp parallel
+    {
+        int t = omp_get_thread_num();
+        for ( int e=0; e<PERF_EVENTS; e++ )
+            begin[t][phase][e] = read_counter ( fd[t][e] );
+    }
+}
+
+
+void
+perf_end ( int phase )
+{
+    #pragma omp parallel
+    {
+        int t = omp_get_thread_num();
+        for ( int e=0; e<PERF_EVENTS; e++ )
+            total[t][phase][e] +=
+                read_counter ( fd[t][e] ) - begin[t][phase][e];
+    }
+}
+
+
+/* Print the counters of every rank next to the phase timers */
+void
+perf_report ( void )
+{
+    double local[PERF_PHASES][PERF_EVENTS], all[size][PERF_PHASES][PERF_EVENTS];
+    for ( int p=0; p<PERF_PHASES; p++ )
+        for ( int e=0; e<PERF_EVENTS; e++ )
+        {
+            local[p][e] = 0.0;
+            for ( int t=0; t<n_threads; t++ )
+                local[p][e] += total[t][p][e];
+        }
+    MPI_Gather ( local, PERF_PHASES*PERF_EVENTS, MPI_DOUBLE,
+        all, PERF_PHASES*PERF_EVENTS, MPI_DOUBLE, 0, comm
+    );
+    if ( rank != 0 )
+        return;
+
+    printf ( "%-20s %5s %12s %12s %6s %12s %13s\n", "Counters", "rank",
+        "cycles", "instructions", "IPC", "LLC-misses", "branch-misses"
+    );
+    for ( int p=0; p<PERF_PHASES; p++ )
+        for ( int r=0; r<size; r++ )
+        {
+            double *c = all[r][p];
+            printf ( "%-20s %5d %12.4e %12.4e %6.2lf %12.4e %13.4e\n",
+                phase_names[p], r, c[0], c[1],
+                ( c[0] > 0.0 ) ? c[1] / c[0] : 0.0, c[2], c[3]
+            );
+        }
+}
+
+
+void
+perf_finalize ( void )
+{
+    for ( int t=0; t<n_threads; t++ )
+        for ( int e=0; e<PERF_EVENTS; e++ )
+            if ( fd[t][e] >= 0 )
+                close ( fd[t][e] );
+    free ( fd );
+    free ( begin );
+    free ( total );
+}
+#endif //WITH_PERF
@@ -0,0 +1,252 @@
+#include "sph.h"
+#include <errno.h>
+#include <float.h>
+#ifdef WITH_ZLIB
+#include <zlib.h>
+#endif //WITH_ZLIB
+
+/* Frames drawn straight from particles: every particle is a disc of one
+ * value (pressure, speed, or nothing for plain dots) in a grid of floats,
+ * where the largest value wins. Grids of several ranks combine with a
+ * max reduction, and are colored only when written. PNG is written with
+ * stored (uncompressed) deflate blocks, or compressed with -DWITH_ZLIB.
+ */
+#define EMPTY_PIXEL (-FLT_MAX)
+
+static const char *field_names[] = { "dots", "pressure", "speed" };
+
+
+/* Set up frames of 'width' pixels over the tank from a spec 'field' or
+ * 'field:ppm', false if the field is unknown
+ */
+bool
+raster_setup ( raster_t *r, const char *spec, int width,
+    real_t tank, real_t height, real_t delta )
+{
+    size_t length = strcspn ( spec, ":" );
+    int field = -1;
+    for ( int f=0; f<(int)(sizeof(field_names)/sizeof(field_names[0])); f++ )
+        if ( strlen ( field_names[f] ) == length
+            && strncmp ( spec, field_names[f], length ) == 0 )
+            field = f;
+    if ( field < 0 || width <= 0 )
+        return false;
+
+    r->field = (raster_field_t) field;
+    r->ppm = ( strcmp ( spec + length, ":ppm" ) == 0 );
+    r->x_max = tank;
+    r->y_max = 2.0 * height;
+    r->width = width;
+    r->height = MAX ( 1, (int) lround ( width * r->y_max / r->x_max ) );
+    r->radius = (int) lround ( 0.5 * delta * width / tank );
+    /* Hydrostatic pressure at the bottom, speed of a free fall from the top */
+    r->top = ( r->field == RASTER_PRESSURE )
+        ? density * 9.81 * height : sqrt ( 2.0 * 9.81 * height );
+    return true;
+}
+
+
+void
+raster_splat ( const raster_t *r, const particle_t *particles, int_t n,
+    float *grid )
+{
+    real_t scale_x = r->width / r->x_max, scale_y = r->height / r->y_max;
+    for ( int_t i=0; i<(int_t) r->width * r->height; i++ )
+        grid[i] = EMPTY_PIXEL;
+
+    for ( int_t k=0; k<n; k++ )
+    {
+        const particle_t *p = &particles[k];
+        float value = 0.0f;
+        if ( r->field == RASTER_PRESSURE )
+            value = p->p;
+        else if ( r->field == RASTER_SPEED )
+            value = sqrt ( p->v[0]*p->v[0] + p->v[1]*p->v[1] );
+
+        /* Row 0 is the top of the image */
+        int cx = (int) floor ( p->x[0] * scale_x ),
+            cy = (int) floor ( (r->y_max - p->x[1]) * scale_y );
+        for ( int dy=-r->radius; dy<=r->radius; dy++ )
+            for ( int dx=-r->radius; dx<=r->radius; dx++ )
+            {
+                int x = cx + dx, y = cy + dy;
+                if ( dx*dx + dy*dy > r->radius * r->radius
+                    || x < 0 || x >= r->width || y < 0 || y >= r->height )
+                    continue;
+                float *pixel = &grid[(int_t) y * r->width + x];
+                *pixel = MAX ( *pixel, value );
+            }
+    }
+}
+
+
+/* White background, black dots, fields from blue over green to red */
+static void
+raster_color ( const raster_t *r, float value, unsigned char *rgb )
+{
+    if ( value == EMPTY_PIXEL )
+        rgb[0] = rgb[1] = rgb[2] = 255;
+    else if ( r->field == RASTER_DOTS )
+        rgb[0] = rgb[1] = rgb[2] = 0;
+    else
+    {
+        real_t s = MIN ( 1.0, MAX ( 0.0, value / r->top ) );
+        for ( int c=0; c<3; c++ )
+        {
+            real_t level = 1.5 - fabs ( 4.0*s - (3-c) );
+            rgb[c] = (unsigned char) ( 255.0 * MIN ( 1.0, MAX ( 0.0, level ) ) );
+        }
+    }
+}
+
+
+static uint32_t crc_table[256];
+static bool crc_ready = false;
+
+static uint32_t
+crc32_update ( uint32_t crc, const unsigned char *data, size_t length )
+{
+    #pragma omp critical (raster_crc)
+    if ( !crc_ready )
+    {
+        for ( uint32_t n=0; n<256; n++ )
+        {
+            uint32_t c = n;
+            for ( int b=0; b<8; b++ )
+                c = ( c & 1 ) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            crc_table[n] = c;
+        }
+        crc_ready = true;
+    }
+    crc = ~crc;
+    for ( size_t i=0; i<length; i++ )
+        crc = crc_table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+
+static void
+put_u32 ( unsigned char *at, uint32_t value )
+{
+    at[0] = value >> 24, at[1] = value >> 16, at[2] = value >> 8, at[3] = value;
+}
+
+
+static void
+png_chunk ( FILE *out, const char *type, const unsigned char *data,
+    size_t length )
+{
+    unsigned char word[4];
+    put_u32 ( word, length );
+    fwrite ( word, 1, 4, out );
+    fwrite ( type, 1, 4, out );
+    fwrite ( data, 1, length, out );
+    put_u32 ( word, crc32_update (
+        crc32_update ( 0, (const unsigned char *) type, 4 ), data, length
+    ) );
+    fwrite ( word, 1, 4, out );
+}
+
+
+/* Scanlines (filter byte 0, then RGB) as a zlib stream */
+static unsigned char *
+png_deflate ( const unsigned char *raw, size_t length, size_t *packed )
+{
+#ifdef WITH_ZLIB
+    uLongf bound = compressBound ( length );
+    unsigned char *stream = malloc ( bound );
+    if ( stream == NULL
+        || compress2 ( stream, &bound, raw, length, Z_BEST_SPEED ) != Z_OK )
+    {
+        free ( stream );
+        return NULL;
+    }
+    *packed = bound;
+    return stream;
+#else
+    size_t blocks = MAX ( 1, (length + 65534) / 65535 );
+    unsigned char *stream = malloc ( 2 + 5*blocks + length + 4 ), *at = stream;
+    if ( stream == NULL )
+        return NULL;
+    *at++ = 0x78, *at++ = 0x01;
+    uint32_t a = 1, b = 0;
+    for ( size_t begin=0, block=0; block<blocks; block++ )
+    {
+        size_t size = MIN ( (size_t) 65535, length - begin );
+        *at++ = ( block == blocks-1 );   // Last block flag, stored
+        *at++ = size & 0xff, *at++ = size >> 8;
+        *at++ = ~size & 0xff, *at++ = (~size >> 8) & 0xff;
+        memcpy ( at, raw + begin, size );
+        for ( size_t i=0; i<size; i++ )
+        {
+            a = (a + raw[begin+i]) % 65521;
+            b = (b + a) % 65521;
+        }
+        at += size, begin += size;
+    }
+    put_u32 ( at, (b << 16) | a );
+    *packed = (at + 4) - stream;
+    return stream;
+#endif //WITH_ZLIB
+}
+
+
+/* Color a grid and write it as PNG or PPM, nonzero on failure */
+int
+raster_write ( const raster_t *r, const float *grid, const char *filename )
+{
+    size_t row = 1 + 3 * (size_t) r->width;
+    unsigned char *raw = malloc ( row * r->height );
+    if ( raw == NULL )
+        return ENOMEM;
+    for ( int y=0; y<r->height; y++ )
+    {
+        raw[y*row] = 0;     // PNG filter type None
+        for ( int x=0; x<r->width; x++ )
+            raster_color ( r, grid[(int_t) y * r->width + x],
+                &raw[y*row + 1 + 3*x]
+            );
+    }
+
+    FILE *out = fopen ( filename, "wb" );
+    if ( out == NULL )
+    {
+        free ( raw );
+        return errno;
+    }
+    int status = 0;
+    if ( r->ppm )
+    {
+        fprintf ( out, "P6\n%d %d\n255\n", r->width, r->height );
+        for ( int y=0; y<r->height; y++ )
+            fwrite ( &raw[y*row + 1], 1, row-1, out );
+    }
+    else
+    {
+        static const unsigned char signature[8] =
+            { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+        unsigned char header[13];
+        put_u32 ( header, r->width );
+        put_u32 ( header+4, r->height );
+        header[8] = 8;      // Bits per channel
+        header[9] = 2;      // RGB
+        header[10] = header[11] = header[12] = 0;
+        size_t packed;
+        unsigned char *stream = png_deflate ( raw, row * r->height, &packed );
+        if ( stream == NULL )
+            status = ENOMEM;
+        else
+        {
+            fwrite ( signature, 1, 8, out );
+            png_chunk ( out, "IHDR", header, 13 );
+            png_chunk ( out, "IDAT", stream, packed );
+            png_chunk ( out, "IEND", NULL, 0 );
+            free ( stream );
+        }
+    }
+    if ( ferror ( out ) )
+        status = EIO;
+    fclose ( out );
+    free ( raw );
+    return status;
+}
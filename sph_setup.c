@@ -0,0 +1,207 @@
+#include "sph.h"
+#include <errno.h>
+#include <libgen.h>
+
+/* Setup shared by the solver and the offline tools: the problem, as set
+ * with '-p' and '-f', and the files a checkpoint is stored in. Nothing
+ * here touches MPI or the particles, so raster links it as it is.
+ */
+
+/* Problem parameters, unset ones are derived in problem_derive() */
+problem_t problem = {
+    .scale = SCALE_DEFAULT,
+    .height = NAN,
+    .width = NAN,
+    .tank = NAN,
+    .delta = 0.01,
+    .h = NAN,
+    .dt = DT_DEFAULT,
+    .sound_speed = 50.0,
+#ifdef FIXED_SCALE_K
+    .kernel_support = FIXED_SCALE_K,
+#else
+    .kernel_support = NAN,
+#endif //FIXED_SCALE_K
+    .kernel = KERNEL_QUINTIC
+};
+
+/* Smoothing kernels by name, with their support and normalization */
+const kernel_info_t kernels[N_KERNELS] = {
+    [KERNEL_QUINTIC] = { "quintic", 3.0, 7.0 / (478.0 * M_PI) },
+    [KERNEL_CUBIC] = { "cubic", 2.0, 10.0 / (7.0 * M_PI) },
+    [KERNEL_WENDLAND2] = { "wendland2", 2.0, 7.0 / (4.0 * M_PI) },
+    [KERNEL_WENDLAND4] = { "wendland4", 2.0, 9.0 / (4.0 * M_PI) }
+};
+
+
+/* Set one problem parameter from a 'key=value' string, false if it does
+ * not parse or the value is not positive
+ */
+bool
+problem_parameter ( char *key_value )
+{
+    static const struct { const char *key; real_t *value; } keys[] = {
+        { "scale", &problem.scale },
+        { "T", &problem.height },
+        { "L", &problem.width },
+        { "B", &problem.tank },
+        { "DELTA", &problem.delta },
+        { "H", &problem.h },
+        { "dt", &problem.dt },
+        { "sos", &problem.sound_speed },
+        { "scale_k", &problem.kernel_support }
+    };
+    char key[64], text[64], *end;
+    int used = 0;
+
+    /* Accept blanks around '=', nothing but blanks after the value */
+    if ( sscanf ( key_value, " %63[^= \t] = %63s%n", key, text, &used ) != 2
+        || key_value[used + strspn ( key_value+used, " \t\n" )] != '\0' )
+        return false;
+    if ( strcmp ( key, "kernel" ) == 0 )
+    {
+        for ( int k=0; k<N_KERNELS; k++ )
+            if ( strcmp ( text, kernels[k].name ) == 0 )
+            {
+                problem.kernel = k;
+                return true;
+            }
+        return false;
+    }
+    /* Lengths, steps and speeds are all positive */
+    real_t value = strtod ( text, &end );
+    if ( end == text || *end != '\0' || !isfinite ( value ) || value <= 0.0 )
+        return false;
+    for ( size_t k=0; k<sizeof(keys)/sizeof(keys[0]); k++ )
+        if ( strcmp ( key, keys[k].key ) == 0 )
+        {
+            *(keys[k].value) = value;
+            return true;
+        }
+    return false;
+}
+
+
+/* Apply the settings of file 'filename' (if not NULL), then the ones in
+ * 'settings'. Reports every bad one, 0 or the errno code to stop with.
+ */
+int
+problem_read ( const char *filename, char *settings[], int n_settings )
+{
+    bool valid = true;
+    if ( filename != NULL )
+    {
+        FILE *in = fopen ( filename, "r" );
+        if ( in == NULL )
+        {
+            fprintf ( stderr, "Error: unable to open '%s', aborting\n",
+                filename
+            );
+            return ENOENT;
+        }
+        char line[256];
+        while ( fgets ( line, 256, in ) != NULL )
+        {
+            line[strcspn ( line, "#\n" )] = '\0';  // Strip comments
+            if ( strspn ( line, " \t" ) == strlen ( line ) )
+                continue;
+            if ( !problem_parameter ( line ) )
+            {
+                fprintf ( stderr, "Error: bad setting '%s' in '%s'\n",
+                    line, filename
+                );
+                valid = false;
+            }
+        }
+        fclose ( in );
+    }
+    // Command line settings override the file
+    for ( int s=0; s<n_settings; s++ )
+        if ( !problem_parameter ( settings[s] ) )
+        {
+            fprintf ( stderr, "Error: bad setting '%s'\n", settings[s] );
+            valid = false;
+        }
+    return valid ? 0 : EINVAL;
+}
+
+
+/* Derive the parameters left unset from the scale and resolution */
+void
+problem_derive ( void )
+{
+    if ( isnan ( problem.height ) )
+        problem.height = 0.6 * problem.scale;
+    if ( isnan ( problem.width ) )
+        problem.width = 1.2 * problem.scale;
+    if ( isnan ( problem.tank ) )
+        problem.tank = 3.22 * problem.scale;
+    if ( isnan ( problem.h ) )
+        problem.h = 0.94 * problem.delta * 1.4142135623;
+    if ( isnan ( problem.kernel_support ) )
+        problem.kernel_support = kernels[problem.kernel].support;
+}
+
+
+/* 'plot/0012.dat' becomes 'plot/0012.idx', in 'index' of at least
+ * strlen(filename)+8 characters
+ */
+void
+aggregate_index_name ( char *index, const char *filename )
+{
+    strcpy ( index, filename );
+    char *dot = strrchr ( index, '.' ), *slash = strrchr ( index, '/' );
+    if ( dot == NULL || ( slash != NULL && slash > dot ) )
+        dot = index + strlen ( index );
+    strcpy ( dot, ".idx" );
+}
+
+
+/* The files holding checkpoint 'filename' in idx order: the file itself,
+ * or the subfiles listed in its index. Their number, 0 if neither exists
+ * or a name does not fit, names in *parts (to be freed).
+ */
+int
+aggregate_parts ( const char *filename, char (**parts)[256] )
+{
+    *parts = NULL;
+    if ( access ( filename, R_OK ) == 0 )
+    {
+        *parts = malloc ( sizeof(**parts) );
+        strncpy ( (*parts)[0], filename, 255 );
+        (*parts)[0][255] = '\0';
+        return 1;
+    }
+
+    char index[strlen ( filename ) + 8], dir[strlen ( filename ) + 1];
+    aggregate_index_name ( index, filename );
+    strcpy ( dir, filename );
+    FILE *in = fopen ( index, "r" );
+    if ( in == NULL )
+        return 0;
+
+    int n_parts = 0, cap = 0;
+    char line[512], part[256], *directory = dirname ( dir );
+    while ( fgets ( line, sizeof(line), in ) != NULL )
+    {
+        if ( line[0] == '#' || sscanf ( line, "%255s", part ) != 1 )
+            continue;
+        if ( n_parts == cap )
+        {
+            cap = MAX ( 16, 2*cap );
+            *parts = realloc ( *parts, cap * sizeof(**parts) );
+        }
+        if ( snprintf ( (*parts)[n_parts++], 256, "%s/%s", directory, part )
+            >= 256 )
+        {
+            fprintf ( stderr, "Error: subfile name '%s/%s' is too long\n",
+                directory, part
+            );
+            free ( *parts );
+            *parts = NULL, n_parts = 0;
+            break;
+        }
+    }
+    fclose ( in );
+    return n_parts;
+}
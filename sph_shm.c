@@ -0,0 +1,217 @@
+#include "sph.h"
+
+/* Internals of sph.c required for the border exchange */
+extern int_t n_field, n_virt, n_mirror;
+extern particle_t *list;
+extern real_t subdomain[2], halo_width;
+
+#ifdef WITH_SHM
+/* Ranks sharing a node publish their border particles in an MPI-3 shared
+ * memory window, on-node neighbors copy them straight out of it. Only
+ * neighbors on other nodes are served by messages.
+ *
+ * Segment layout: two counts (westbound, eastbound) followed by the
+ * westbound particles, then the eastbound ones.
+ */
+#define SHM_HEADER (2*sizeof(int_t))
+
+static MPI_Comm node_comm;
+static MPI_Win window;
+static int
+    node_west = MPI_PROC_NULL,  // Neighbor ranks within node_comm,
+    node_east = MPI_PROC_NULL;  // MPI_PROC_NULL when they are off-node
+static int_t shm_capacity = 0;  // Particles per segment
+static char
+    *segment = NULL,            // My own segment
+    *west_segment = NULL,       // Segments of on-node neighbors
+    *east_segment = NULL;
+
+
+static void
+shm_allocate ( int_t capacity )
+{
+    MPI_Aint bytes = SHM_HEADER + capacity * sizeof(particle_t), seg_size;
+    int disp_unit;
+
+    shm_capacity = capacity;
+    MPI_Win_allocate_shared ( bytes, 1, MPI_INFO_NULL, node_comm,
+        &segment, &window
+    );
+    if ( node_west != MPI_PROC_NULL )
+        MPI_Win_shared_query ( window, node_west,
+            &seg_size, &disp_unit, &west_segment
+        );
+    if ( node_east != MPI_PROC_NULL )
+        MPI_Win_shared_query ( window, node_east,
+            &seg_size, &disp_unit, &east_segment
+        );
+    /* One passive epoch for the whole run, steps synchronize by
+     * MPI_Win_sync around a node-local collective
+     */
+    MPI_Win_lock_all ( MPI_MODE_NOCHECK, window );
+}
+
+
+static void
+shm_free ( void )
+{
+    MPI_Win_unlock_all ( window );
+    MPI_Win_free ( &window );
+    segment = west_segment = east_segment = NULL;
+}
+
+
+void
+shm_init ( void )
+{
+    MPI_Comm_split_type ( comm, MPI_COMM_TYPE_SHARED, rank,
+        MPI_INFO_NULL, &node_comm
+    );
+
+    /* Find out which neighbors share my node */
+    MPI_Group comm_group, node_group;
+    int neighbors[2] = { west, east }, node_neighbors[2];
+    MPI_Comm_group ( comm, &comm_group );
+    MPI_Comm_group ( node_comm, &node_group );
+    MPI_Group_translate_ranks ( comm_group, 2, neighbors,
+        node_group, node_neighbors
+    );
+    MPI_Group_free ( &comm_group );
+    MPI_Group_free ( &node_group );
+    if ( west != rank && node_neighbors[0] != MPI_UNDEFINED )
+        node_west = node_neighbors[0];
+    if ( east != rank && node_neighbors[1] != MPI_UNDEFINED )
+        node_east = node_neighbors[1];
+
+    shm_allocate ( 4096 );
+}
+
+
+void
+shm_finalize ( void )
+{
+    shm_free ();
+    MPI_Comm_free ( &node_comm );
+}
+
+
+void
+border_exchange ( void )
+{
+    int_t
+        export_east = 0, export_west = 0,
+        import_east = 0, import_west = 0;
+
+    // Find the particles within neighbor reach
+    halo_select ( &export_west, &export_east );
+
+    /* Counts travel by message only to off-node neighbors,
+     * tag 0 is westbound and tag 1 eastbound traffic
+     */
+    MPI_Request req[4];
+    int n_req = 0;
+    if ( node_east == MPI_PROC_NULL )
+    {
+        MPI_Irecv ( &import_east, 1, INT_MACRO_MPI, east, 0,
+            comm, &req[n_req++] );
+        MPI_Isend ( &export_east, 1, INT_MACRO_MPI, east, 1,
+            comm, &req[n_req++] );
+    }
+    if ( node_west == MPI_PROC_NULL )
+    {
+        MPI_Irecv ( &import_west, 1, INT_MACRO_MPI, west, 1,
+            comm, &req[n_req++] );
+        MPI_Isend ( &export_west, 1, INT_MACRO_MPI, west, 0,
+            comm, &req[n_req++] );
+    }
+
+    // Serialize into my segment when it fits, private buffer otherwise
+    int_t required = export_west + export_east;
+    bool in_segment = ( required <= shm_capacity );
+    particle_t *transfer = in_segment
+        ? (particle_t *) (segment + SHM_HEADER)
+        : (particle_t *) malloc ( required * sizeof(particle_t) );
+    halo_pack ( transfer );
+    ((int_t *)segment)[0] = export_west;
+    ((int_t *)segment)[1] = export_east;
+
+    /* The one node-wide synchronization per step. It publishes the
+     * segments, and agrees on growing them if anyone overflowed.
+     * Segments are not rewritten before the next step's exchange, which
+     * neighbors cannot reach before our migrate_particles() has
+     * received from them, i.e. before they finished reading here.
+     */
+    int_t node_required;
+    MPI_Win_sync ( window );
+    MPI_Allreduce ( &required, &node_required, 1, INT_MACRO_MPI, MPI_MAX,
+        node_comm
+    );
+    MPI_Win_sync ( window );
+    if ( node_required > shm_capacity )
+    {
+        if ( in_segment )
+        {
+            transfer = malloc ( required * sizeof(particle_t) );
+            memcpy ( transfer, segment + SHM_HEADER,
+                required * sizeof(particle_t) );
+        }
+        shm_free ();
+        shm_allocate ( node_required + node_required/2 );
+        memcpy ( segment + SHM_HEADER, transfer,
+            required * sizeof(particle_t) );
+        free ( transfer );
+        transfer = (particle_t *) (segment + SHM_HEADER);
+        in_segment = true;
+        ((int_t *)segment)[0] = export_west;
+        ((int_t *)segment)[1] = export_east;
+        MPI_Win_sync ( window );
+        MPI_Barrier ( node_comm );
+        MPI_Win_sync ( window );
+    }
+
+    if ( node_east != MPI_PROC_NULL )
+        import_east = ((int_t *)east_segment)[0];
+    if ( node_west != MPI_PROC_NULL )
+        import_west = ((int_t *)west_segment)[1];
+    MPI_Waitall ( n_req, req, MPI_STATUSES_IGNORE );
+
+    n_mirror = import_east + import_west;
+    resize_list ( n_field + n_virt + n_mirror );
+
+    /* Same placement as the message version: west mirrors first */
+    particle_t
+        *from_west = &(list[n_field+n_virt]),
+        *from_east = &(list[n_field+n_virt+import_west]);
+    n_req = 0;
+    if ( node_east != MPI_PROC_NULL )
+        memcpy ( from_east, east_segment + SHM_HEADER,
+            import_east * sizeof(particle_t) );
+    else
+    {
+        MPI_Irecv ( from_east, import_east*sizeof(particle_t), MPI_BYTE,
+            east, 0, comm, &req[n_req++] );
+        MPI_Isend ( &(transfer[export_west]),
+            export_east*sizeof(particle_t), MPI_BYTE,
+            east, 1, comm, &req[n_req++] );
+    }
+    if ( node_west != MPI_PROC_NULL )
+    {
+        int_t west_offset = ((int_t *)west_segment)[0];
+        memcpy ( from_west,
+            west_segment + SHM_HEADER + west_offset * sizeof(particle_t),
+            import_west * sizeof(particle_t) );
+    }
+    else
+    {
+        MPI_Irecv ( from_west, import_west*sizeof(particle_t), MPI_BYTE,
+            west, 1, comm, &req[n_req++] );
+        MPI_Isend ( &(transfer[0]),
+            export_west*sizeof(particle_t), MPI_BYTE,
+            west, 0, comm, &req[n_req++] );
+    }
+    MPI_Waitall ( n_req, req, MPI_STATUSES_IGNORE );
+
+    if ( !in_segment )
+        free ( transfer );
+}
+#endif //WITH_SHM
@@ -0,0 +1,245 @@
+#include "sph.h"
+
+#ifdef WITH_TRACE
+/* Timeline of OpenMP regions and MPI calls. Every thread records spans
+ * into its own ring buffer, so recording takes no locks. The newest
+ * TRACE_EVENTS spans per thread are kept, and written at the end as one
+ * Chrome trace (JSON) for all ranks, with rank as process and OpenMP
+ * thread as thread. MPI calls are caught through the PMPI interface.
+ */
+#ifdef NO_MPI
+#define PMPI_Barrier MPI_Barrier    // Nothing to intercept without MPI
+#endif //NO_MPI
+
+typedef struct {
+    const char *name;
+    bool mpi;
+    double begin, end;
+} span_t;
+
+/* Padded so neighboring threads don't share a cache line */
+typedef struct {
+    span_t *spans;
+    uint64_t count;     // Spans ever recorded, the ring keeps the last ones
+    char pad[64 - sizeof(span_t *) - sizeof(uint64_t)];
+} ring_t;
+
+static int n_threads = 0;
+static ring_t *rings = NULL;
+static double t_origin;
+
+
+double
+trace_time ( void )
+{
+    return omp_get_wtime();
+}
+
+
+static void
+record ( const char *name, bool mpi, double begin )
+{
+    if ( rings == NULL )
+        return;
+    int t = omp_get_thread_num();
+    ring_t *r = &rings[t];
+    span_t *s = &(r->spans[r->count % TRACE_EVENTS]);
+    s->name = name, s->mpi = mpi;
+    s->begin = begin, s->end = omp_get_wtime();
+    r->count += 1;
+}
+
+
+void
+trace_event ( const char *name, double begin )
+{
+    record ( name, false, begin );
+}
+
+
+void
+trace_init ( void )
+{
+    n_threads = omp_get_max_threads();
+    ring_t *new_rings = calloc ( n_threads, sizeof(ring_t) );
+    for ( int t=0; t<n_threads; t++ )
+        new_rings[t].spans = malloc ( TRACE_EVENTS * sizeof(span_t) );
+
+    // Common time origin for all ranks, up to barrier skew
+    PMPI_Barrier ( comm );
+    t_origin = omp_get_wtime();
+    rings = new_rings;
+}
+
+
+/* Ranks append their spans to the trace one after the other */
+void
+trace_finalize ( void )
+{
+    ring_t *done = rings;
+    rings = NULL;       // Stop recording
+
+    char filename[256];
+    sprintf ( filename, "%s/trace.json", output_dir );
+    for ( int r=0; r<size; r++ )
+    {
+        if ( r == rank )
+        {
+            FILE *out = fopen ( filename, ( rank == 0 ) ? "w" : "a" );
+            if ( out == NULL )
+            {
+                fprintf ( stderr, "Error: Rank %d unable to write '%s'\n",
+                    rank, filename
+                );
+                break;
+            }
+            if ( rank == 0 )
+                fprintf ( out, "{\"traceEvents\":[\n" );
+            fprintf ( out, "%s{\"name\":\"process_name\",\"ph\":\"M\","
+                "\"pid\":%d,\"args\":{\"name\":\"Rank %d\"}}",
+                ( rank == 0 ) ? "" : ",\n", rank, rank
+            );
+            for ( int t=0; t<n_threads; t++ )
+            {
+                ring_t *ring = &done[t];
+                uint64_t first = ( ring->count > TRACE_EVENTS )
+                    ? ring->count - TRACE_EVENTS : 0;
+                if ( first > 0 )
+                    fprintf ( stderr, "Rank %d: Warning, thread %d dropped "
+                        "its %lu oldest trace spans\n", rank, t,
+                        (unsigned long)first
+                    );
+                for ( uint64_t k=first; k<ring->count; k++ )
+                {
+                    span_t *s = &(ring->spans[k % TRACE_EVENTS]);
+                    fprintf ( out, ",\n{\"name\":\"%s\",\"cat\":\"%s\","
+                        "\"ph\":\"X\",\"ts\":%.3lf,\"dur\":%.3lf,"
+                        "\"pid\":%d,\"tid\":%d}",
+                        s->name, s->mpi ? "mpi" : "omp",
+                        1e6 * (s->begin - t_origin),
+                        1e6 * (s->end - s->begin), rank, t
+                    );
+                }
+                free ( ring->spans );
+            }
+            if ( rank == size-1 )
+                fprintf ( out, "\n]}\n" );
+            fclose ( out );
+        }
+        PMPI_Barrier ( comm );
+    }
+    free ( done );
+    if ( rank == 0 )
+        printf ( "Trace written to '%s'\n", filename );
+}
+
+
+#ifndef NO_MPI
+/* MPI calls of the solver, timed around the PMPI entry points */
+int
+MPI_Sendrecv ( const void *sendbuf, int sendcount, MPI_Datatype sendtype,
+    int dest, int sendtag, void *recvbuf, int recvcount,
+    MPI_Datatype recvtype, int source, int recvtag,
+    MPI_Comm mpi_comm, MPI_Status *status )
+{
+    double begin = omp_get_wtime();
+    int result = PMPI_Sendrecv ( sendbuf, sendcount, sendtype, dest, sendtag,
+        recvbuf, recvcount, recvtype, source, recvtag, mpi_comm, status
+    );
+    record ( "MPI_Sendrecv", true, begin );
+    return result;
+}
+
+
+int
+MPI_Send ( const void *buf, int count, MPI_Datatype datatype, int dest,
+    int tag, MPI_Comm mpi_comm )
+{
+    double begin = omp_get_wtime();
+    int result = PMPI_Send ( buf, count, datatype, dest, tag, mpi_comm );
+    record ( "MPI_Send", true, begin );
+    return result;
+}
+
+
+int
+MPI_Ssend ( const void *buf, int count, MPI_Datatype datatype, int dest,
+    int tag, MPI_Comm mpi_comm )
+{
+    double begin = omp_get_wtime();
+    int result = PMPI_Ssend ( buf, count, datatype, dest, tag, mpi_comm );
+    record ( "MPI_Ssend", true, begin );
+    return result;
+}
+
+
+int
+MPI_Recv ( void *buf, int count, MPI_Datatype datatype, int source,
+    int tag, MPI_Comm mpi_comm, MPI_Status *status )
+{
+    double begin = omp_get_wtime();
+    int result = PMPI_Recv ( buf, count, datatype, source, tag, mpi_comm,
+        status
+    );
+    record ( "MPI_Recv", true, begin );
+    return result;
+}
+
+
+int
+MPI_Waitall ( int count, MPI_Request requests[], MPI_Status statuses[] )
+{
+    double begin = omp_get_wtime();
+    int result = PMPI_Waitall ( count, requests, statuses );
+    record ( "MPI_Waitall", true, begin );
+    return result;
+}
+
+
+int
+MPI_Allreduce ( const void *sendbuf, void *recvbuf, int count,
+    MPI_Datatype datatype, MPI_Op op, MPI_Comm mpi_comm )
+{
+    double begin = omp_get_wtime();
+    int result = PMPI_Allreduce ( sendbuf, recvbuf, count, datatype, op,
+        mpi_comm
+    );
+    record ( "MPI_Allreduce", true, begin );
+    return result;
+}
+
+
+int
+MPI_Barrier ( MPI_Comm mpi_comm )
+{
+    double begin = omp_get_wtime();
+    int result = PMPI_Barrier ( mpi_comm );
+    record ( "MPI_Barrier", true, begin );
+    return result;
+}
+
+
+int
+MPI_Bcast ( void *buffer, int count, MPI_Datatype datatype, int root,
+    MPI_Comm mpi_comm )
+{
+    double begin = omp_get_wtime();
+    int result = PMPI_Bcast ( buffer, count, datatype, root, mpi_comm );
+    record ( "MPI_Bcast", true, begin );
+    return result;
+}
+
+
+int
+MPI_File_write_at_all ( MPI_File fh, MPI_Offset offset, const void *buf,
+    int count, MPI_Datatype datatype, MPI_Status *status )
+{
+    double begin = omp_get_wtime();
+    int result = PMPI_File_write_at_all ( fh, offset, buf, count, datatype,
+        status
+    );
+    record ( "MPI_File_write_at_all", true, begin );
+    return result;
+}
+#endif //NO_MPI
+#endif //WITH_TRACE
@@ -0,0 +1,13 @@
+#!/bin/bash
+# Surge front of a run, the largest x of any fluid particle, one line
+# 'time front' per checkpoint in DIR. STEP is the time between checkpoints
+# (checkpoint frequency * dt). cp2txt must be built with the solver's flags,
+# checkpoints are the particles as the solver stores them.
+DIR=${1:-plot}
+STEP=${2:-0.02}
+
+for f in ${DIR}/[0-9]*.dat; do
+    ./cp2txt -f $f | awk -v n=$(basename $f .dat) -v step=${STEP} '
+        NR == 1 || $2 > front { front = $2 }
+        END { printf "%.4f %.6f\n", (n+0)*step, front }'
+done